@@ -0,0 +1,52 @@
+#pragma once
+
+// Perspective-correct interpolation of N float attributes (texture
+// coordinates, colours, normals...) across a projected triangle. An
+// attribute doesn't change linearly across the screen, but the attribute
+// divided by the vertex's camera-space z does, and so does 1/z, so each of
+// those is set up once per triangle as a plane over the screen: its value at
+// the triangle's first pixel and how much it changes per pixel right and
+// down. A pixel's attributes are then a multiply-add per plane and a single
+// reciprocal of 1/z.
+template <int N>
+class AttributeInterpolator {
+  public:
+    AttributeInterpolator() {}
+
+    // weight[k], weightX[k] and weightY[k] are vertex k's barycentric weight
+    // at the first pixel and its change per pixel right and down; invZ[k] is
+    // 1/z of vertex k and attributes[k] its N attributes
+    void setup(const double weight[3], const double weightX[3], const double weightY[3],
+               const float invZ[3], const float attributes[3][N]) {
+      invZStart = invZStepX = invZStepY = 0.0f;
+      for (int n = 0; n < N; n++) start[n] = stepX[n] = stepY[n] = 0.0f;
+      for (int k = 0; k < 3; k++) {
+        invZStart += weight[k] * invZ[k];
+        invZStepX += weightX[k] * invZ[k];
+        invZStepY += weightY[k] * invZ[k];
+        for (int n = 0; n < N; n++) {
+          float overZ = attributes[k][n] * invZ[k];
+          start[n] += weight[k] * overZ;
+          stepX[n] += weightX[k] * overZ;
+          stepY[n] += weightY[k] * overZ;
+        }
+      }
+    }
+
+    // Writes the attributes at the pixel i right of and j below the first
+    // pixel to out, and returns its z
+    float at(int i, int j, float out[N]) const {
+      float z = 1.0f / (invZStart + (i * invZStepX) + (j * invZStepY));
+      for (int n = 0; n < N; n++) out[n] = (start[n] + (i * stepX[n]) + (j * stepY[n])) * z;
+      return z;
+    }
+
+    // How attribute n changes per pixel right (or down) at a pixel where
+    // at() gave it value and returned z
+    float derivativeX(int n, float value, float z) const { return (stepX[n] - (value * invZStepX)) * z; }
+    float derivativeY(int n, float value, float z) const { return (stepY[n] - (value * invZStepY)) * z; }
+
+  private:
+    float invZStart = 0.0f, invZStepX = 0.0f, invZStepY = 0.0f;
+    float start[N] = {}, stepX[N] = {}, stepY[N] = {};
+};
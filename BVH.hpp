@@ -0,0 +1,359 @@
+#pragma once
+
+#include <glm/glm.hpp>
+#include <vector>
+#include <limits>
+#include <algorithm>
+#include <iostream>
+#include <atomic>
+#include "TriangleStore.hpp"
+
+using namespace std;
+using namespace glm;
+
+// Axis-aligned bounding box, used for both the BVH nodes and the binning
+// done while building it.
+class AABB {
+  public:
+    vec3 lo = vec3(numeric_limits<float>::infinity());
+    vec3 hi = vec3(-numeric_limits<float>::infinity());
+
+    AABB () {}
+
+    void grow(vec3 p) {
+      lo = glm::min(lo, p);
+      hi = glm::max(hi, p);
+    }
+
+    void grow(const AABB& box) {
+      lo = glm::min(lo, box.lo);
+      hi = glm::max(hi, box.hi);
+    }
+
+    bool empty() const { return lo.x > hi.x; }
+
+    float surfaceArea() const {
+      if (empty()) return 0.0f;
+      vec3 d = hi - lo;
+      return 2.0f * ((d.x * d.y) + (d.y * d.z) + (d.z * d.x));
+    }
+
+    // Slab test. invDir is 1/rayDir per component; returns the entry distance
+    // (in units of rayDir) through tNear.
+    bool hitByRay(vec3 origin, vec3 invDir, float tMax, float& tNear) const {
+      vec3 t0 = (lo - origin) * invDir;
+      vec3 t1 = (hi - origin) * invDir;
+      vec3 tSmall = glm::min(t0, t1);
+      vec3 tBig = glm::max(t0, t1);
+      tNear = std::max(std::max(tSmall.x, tSmall.y), std::max(tSmall.z, 0.0f));
+      float tFar = std::min(std::min(tBig.x, tBig.y), std::min(tBig.z, tMax));
+      return tNear <= tFar;
+    }
+};
+
+// Leaves have count > 0 and index the first of their triangles; interior
+// nodes have count == 0 and index their left child (the right child is
+// always the next node along).
+struct BVHNode {
+  AABB bounds;
+  int leftOrFirst;
+  int count;
+};
+
+class BVH {
+  public:
+    vector<BVHNode> nodes;
+    // The scene's triangles, reordered so that each leaf's are contiguous
+    TriangleStore triangles;
+    // Store index of each triangle, numbered in gobject then face order
+    vector<int> storeIndexOf;
+
+    // Traversal counters, reset by resetStats() (e.g. once per frame). Rays
+    // may be traced from several threads, so each ray adds its totals once.
+    atomic<unsigned long> raysCast{0};
+    atomic<unsigned long> nodesVisited{0};
+    atomic<unsigned long> trianglesTested{0};
+    // Back-facing hits culled by primary (closest hit) and shadow (any
+    // hit) rays
+    atomic<unsigned long> backFacesCulled{0};
+    atomic<unsigned long> shadowBackFacesCulled{0};
+
+    BVH () {}
+
+    void build(const vector<GObject>& gobjects) {
+      vector<FaceRef> all;
+      vector<bool> singleSided;
+      collect(gobjects, all, singleSided);
+
+      centroids.resize(all.size());
+      boxes.resize(all.size());
+      for (uint i=0; i<all.size(); i++) {
+        AABB box;
+        for (int k=0; k<3; k++) box.grow(all[i].mesh->vertex(all[i].face, k));
+        boxes[i] = box;
+        centroids[i] = (box.lo + box.hi) * 0.5f;
+      }
+      order.resize(all.size());
+      for (uint i=0; i<order.size(); i++) order[i] = i;
+
+      nodes.clear();
+      nodes.reserve(2 * all.size() + 1);
+      nodes.push_back(BVHNode());
+      nodes[0].leftOrFirst = 0;
+      nodes[0].count = all.size();
+      updateBounds(0);
+      subdivide(0);
+      fillStore(all, singleSided);
+    }
+
+    // Which triangle (numbered in gobject then face order) each place in
+    // the store holds, for saving the tree to restore() later
+    const vector<int>& triangleOrder() const { return order; }
+
+    // Takes back a tree that build() made from these same gobjects, without
+    // building it again. Returns false (leaving the BVH empty) if it doesn't
+    // fit them.
+    bool restore(const vector<GObject>& gobjects, const vector<BVHNode>& savedNodes, const vector<int>& savedOrder) {
+      vector<FaceRef> all;
+      vector<bool> singleSided;
+      collect(gobjects, all, singleSided);
+      nodes.clear();
+      order.clear();
+      triangles.clear();
+      triangles.finish();
+      if (savedOrder.size() != all.size()) return false;
+      for (uint i=0; i<savedOrder.size(); i++) {
+        if (savedOrder[i] < 0 || savedOrder[i] >= (int)all.size()) return false;
+      }
+      for (uint n=0; n<savedNodes.size(); n++) {
+        const BVHNode& node = savedNodes[n];
+        bool fits = (node.count > 0) ? (node.leftOrFirst >= 0 && node.leftOrFirst + node.count <= (int)all.size())
+                                     : (node.leftOrFirst > (int)n && node.leftOrFirst + 1 < (int)savedNodes.size());
+        if (!fits) return false;
+      }
+      nodes = savedNodes;
+      order = savedOrder;
+      fillStore(all, singleSided);
+      return true;
+    }
+
+    // Walk the tree front to back, calling visit(first, count, tMax) for
+    // every leaf the ray reaches before tMax, where first and count give the
+    // leaf's range of triangles in the store. The visitor may shrink
+    // tMax (closest hit) or return true to stop the walk (any hit).
+    // Distances are in units of rayDir, i.e. origin + t*rayDir.
+    // Back faces culled along the way count as backFacesCulled.
+    template <typename Visitor>
+    void traverse(vec3 origin, vec3 rayDir, float tMax, Visitor visit) {
+      trace(origin, rayDir, tMax, visit, backFacesCulled);
+    }
+
+    // Any-hit query for shadow rays: true as soon as any triangle other than
+    // ignore (an index into the store) is found closer than tMax.
+    bool occluded(vec3 origin, vec3 rayDir, float tMax, int ignore = -1) {
+      bool hit = false;
+      trace(origin, rayDir, tMax,
+        [&](int first, int count, float& tMax) {
+          hit = triangles.anyInRange(first, count, origin, rayDir, tMax, ignore);
+          return hit;
+        }, shadowBackFacesCulled);
+      return hit;
+    }
+
+    void resetStats() {
+      raysCast = 0;
+      nodesVisited = 0;
+      trianglesTested = 0;
+      backFacesCulled = 0;
+      shadowBackFacesCulled = 0;
+    }
+
+    void printStats() {
+      cout << "BVH: " << nodes.size() << " nodes over " << triangles.size() << " triangles" << endl;
+      if (raysCast == 0) {
+        cout << "  no rays cast since last reset" << endl;
+        return;
+      }
+      cout << "  rays cast: " << raysCast << endl;
+      cout << "  nodes visited per ray: " << (double)nodesVisited / raysCast << endl;
+      cout << "  triangles tested per ray: " << (double)trianglesTested / raysCast << endl;
+      if (triangles.cullBackFaces) {
+        cout << "  back-facing hits culled: " << backFacesCulled << " by primary rays, "
+             << shadowBackFacesCulled << " by shadow rays" << endl;
+      }
+    }
+
+  private:
+    // Walks the tree for traverse() and occluded(), adding the ray's totals
+    // to the counters and its culled back faces to culled. Culls left on
+    // the thread by tests outside the tree (e.g. benchmarks) are dropped
+    // first, so they're never put down to this ray.
+    template <typename Visitor>
+    void trace(vec3 origin, vec3 rayDir, float tMax, Visitor visit, atomic<unsigned long>& culled) {
+      if (triangles.cullBackFaces) TriangleStore::takeCulledCount();
+      unsigned long nodeCount = 0, triangleCount = 0;
+      walk(origin, rayDir, tMax, visit, nodeCount, triangleCount);
+      raysCast.fetch_add(1, memory_order_relaxed);
+      nodesVisited.fetch_add(nodeCount, memory_order_relaxed);
+      trianglesTested.fetch_add(triangleCount, memory_order_relaxed);
+      if (triangles.cullBackFaces) culled.fetch_add(TriangleStore::takeCulledCount(), memory_order_relaxed);
+    }
+
+    // Build-time scratch, indexed by the original triangle order
+    vector<vec3> centroids;
+    vector<AABB> boxes;
+    vector<int> order;
+
+    // Every triangle, in gobject then face order, and whether it's one
+    // sided
+    static void collect(const vector<GObject>& gobjects, vector<FaceRef>& all, vector<bool>& singleSided) {
+      for (uint j=0; j<gobjects.size(); j++) {
+        const Mesh& mesh = gobjects.at(j).mesh;
+        for (int i=0; i<mesh.faceCount(); i++) {
+          all.push_back({&mesh, i});
+          singleSided.push_back(gobjects.at(j).cullBackFaces);
+        }
+      }
+    }
+
+    void fillStore(const vector<FaceRef>& all, const vector<bool>& singleSided) {
+      triangles.clear();
+      for (uint i=0; i<order.size(); i++) triangles.add(all[order[i]], singleSided[order[i]]);
+      triangles.finish();
+      storeIndexOf.resize(order.size());
+      for (uint i=0; i<order.size(); i++) storeIndexOf[order[i]] = i;
+    }
+
+    static const int NUM_BINS = 12;
+    static const int MAX_DEPTH = 60;
+
+    template <typename Visitor>
+    void walk(vec3 origin, vec3 rayDir, float tMax, Visitor& visit, unsigned long& nodeCount, unsigned long& triangleCount) {
+      if (nodes.empty() || triangles.size() == 0) return;
+      vec3 invDir = 1.0f / rayDir;
+
+      int stack[64];
+      int stackSize = 0;
+      float tNear;
+      if (!nodes[0].bounds.hitByRay(origin, invDir, tMax, tNear)) return;
+      stack[stackSize++] = 0;
+
+      while (stackSize > 0) {
+        const BVHNode& node = nodes[stack[--stackSize]];
+        nodeCount++;
+        if (node.count > 0) {
+          triangleCount += node.count;
+          if (visit(node.leftOrFirst, node.count, tMax)) return;
+          continue;
+        }
+        int near = node.leftOrFirst;
+        int far = node.leftOrFirst + 1;
+        float tA, tB;
+        bool hitA = nodes[near].bounds.hitByRay(origin, invDir, tMax, tA);
+        bool hitB = nodes[far].bounds.hitByRay(origin, invDir, tMax, tB);
+        if (hitA && hitB && tB < tA) std::swap(near, far);
+        // Push the far child first so the near one is popped next
+        if (hitA && hitB) {
+          stack[stackSize++] = far;
+          stack[stackSize++] = near;
+        }
+        else if (hitA) stack[stackSize++] = node.leftOrFirst;
+        else if (hitB) stack[stackSize++] = node.leftOrFirst + 1;
+      }
+    }
+
+    void updateBounds(int nodeIndex) {
+      BVHNode& node = nodes[nodeIndex];
+      node.bounds = AABB();
+      for (int i=0; i<node.count; i++) node.bounds.grow(boxes[order[node.leftOrFirst + i]]);
+    }
+
+    // Binned surface area heuristic: try NUM_BINS-1 split planes along each
+    // axis and keep the cheapest, measured as area-weighted triangle counts.
+    float findBestSplit(const BVHNode& node, int& bestAxis, float& bestPos) {
+      float bestCost = numeric_limits<float>::infinity();
+      for (int axis=0; axis<3; axis++) {
+        float cmin = numeric_limits<float>::infinity();
+        float cmax = -numeric_limits<float>::infinity();
+        for (int i=0; i<node.count; i++) {
+          float c = centroids[order[node.leftOrFirst + i]][axis];
+          cmin = std::min(cmin, c);
+          cmax = std::max(cmax, c);
+        }
+        if (cmin == cmax) continue;
+
+        AABB binBoxes[NUM_BINS];
+        int binCounts[NUM_BINS] = {0};
+        float scale = NUM_BINS / (cmax - cmin);
+        for (int i=0; i<node.count; i++) {
+          int t = order[node.leftOrFirst + i];
+          int b = std::min(NUM_BINS - 1, (int)((centroids[t][axis] - cmin) * scale));
+          binCounts[b]++;
+          binBoxes[b].grow(boxes[t]);
+        }
+
+        // Sweep from both ends to get the area/count either side of each plane
+        float leftArea[NUM_BINS - 1], rightArea[NUM_BINS - 1];
+        int leftCount[NUM_BINS - 1], rightCount[NUM_BINS - 1];
+        AABB leftBox, rightBox;
+        int leftSum = 0, rightSum = 0;
+        for (int i=0; i<NUM_BINS - 1; i++) {
+          leftSum += binCounts[i];
+          leftCount[i] = leftSum;
+          leftBox.grow(binBoxes[i]);
+          leftArea[i] = leftBox.surfaceArea();
+          rightSum += binCounts[NUM_BINS - 1 - i];
+          rightCount[NUM_BINS - 2 - i] = rightSum;
+          rightBox.grow(binBoxes[NUM_BINS - 1 - i]);
+          rightArea[NUM_BINS - 2 - i] = rightBox.surfaceArea();
+        }
+        for (int i=0; i<NUM_BINS - 1; i++) {
+          float cost = (leftCount[i] * leftArea[i]) + (rightCount[i] * rightArea[i]);
+          if (cost < bestCost) {
+            bestCost = cost;
+            bestAxis = axis;
+            bestPos = cmin + ((i + 1) / scale);
+          }
+        }
+      }
+      return bestCost;
+    }
+
+    void subdivide(int nodeIndex, int depth = 0) {
+      BVHNode& node = nodes[nodeIndex];
+      if (node.count <= 2 || depth >= MAX_DEPTH) return;
+
+      int axis = 0;
+      float splitPos = 0.0f;
+      float splitCost = findBestSplit(node, axis, splitPos);
+      float leafCost = node.count * node.bounds.surfaceArea();
+      if (splitCost >= leafCost) return;
+
+      // Partition this node's triangles about the split plane
+      int i = node.leftOrFirst;
+      int j = i + node.count - 1;
+      while (i <= j) {
+        if (centroids[order[i]][axis] < splitPos) i++;
+        else std::swap(order[i], order[j--]);
+      }
+      int leftCount = i - node.leftOrFirst;
+      if (leftCount == 0 || leftCount == node.count) return;
+
+      int leftIndex = nodes.size();
+      BVHNode left, right;
+      left.leftOrFirst = node.leftOrFirst;
+      left.count = leftCount;
+      right.leftOrFirst = i;
+      right.count = node.count - leftCount;
+      nodes.push_back(left);
+      nodes.push_back(right);
+
+      // push_back may have moved the nodes, so don't reuse the reference
+      nodes[nodeIndex].leftOrFirst = leftIndex;
+      nodes[nodeIndex].count = 0;
+      updateBounds(leftIndex);
+      updateBounds(leftIndex + 1);
+      subdivide(leftIndex, depth + 1);
+      subdivide(leftIndex + 1, depth + 1);
+    }
+};
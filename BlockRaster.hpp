@@ -0,0 +1,118 @@
+#pragma once
+
+#include <cstdint>
+#include <algorithm>
+// For SimdLevel and, on x86, the intrinsics
+#include "TriangleStore.hpp"
+
+// A triangle's edge functions and 1/depth at the first pixel of a block of
+// pixels along a row, and how much each changes per pixel along the row.
+// The edge functions are biased by the fill rule, so a pixel is covered when
+// all three are >= 0.
+struct PixelBlock {
+  int32_t w[3];
+  int32_t step[3];
+  float invDepth, invDepthStep;
+};
+
+// The inner loop of the rasteriser, 8 pixels along a row at a time: which of
+// a block's pixels the triangle covers and is nearest the camera at, and
+// storing its colour (or anything else 32 bits wide) to those. AVX2 does a
+// block at once, with masked loads and stores so that blocks may hang off
+// the end of the triangle's row; SSE does a whole block in two halves, and
+// leaves partial blocks to the scalar code.
+class BlockRaster {
+  public:
+    static constexpr int WIDTH = 8;
+
+    // Which kernels to use; defaults to the best this CPU has
+    SimdLevel simdLevel = detectSimdLevel();
+
+    BlockRaster () {}
+
+    // Depth-tests the covered pixels among the first lanes of the block
+    // against depth (1/depth, so larger is nearer), storing 1/depth where
+    // they pass. Returns a bit per pixel (lowest first) that passed.
+    unsigned depthTest(const PixelBlock& block, int lanes, float* depth) const {
+#ifdef TRIANGLE_STORE_X86_SIMD
+      if (simdLevel == SIMD_AVX2) return depthTestAVX2(block, lanes, depth);
+      if (simdLevel == SIMD_SSE && lanes == WIDTH) return depthTestSSE(block, depth);
+#endif
+      return depthTestScalar(block, lanes, depth);
+    }
+
+    // Writes value to the pixels of dst whose bits are set in mask
+    void store(uint32_t* dst, uint32_t value, unsigned mask) const {
+#ifdef TRIANGLE_STORE_X86_SIMD
+      if (simdLevel == SIMD_AVX2) return storeAVX2(dst, value, mask);
+#endif
+      for (; mask != 0; mask &= mask - 1) dst[__builtin_ctz(mask)] = value;
+    }
+
+  private:
+    unsigned depthTestScalar(const PixelBlock& block, int lanes, float* depth) const {
+      unsigned mask = 0;
+      for (int i=0; i<lanes; i++) {
+        int32_t w0 = block.w[0] + (block.step[0] * i);
+        int32_t w1 = block.w[1] + (block.step[1] * i);
+        int32_t w2 = block.w[2] + (block.step[2] * i);
+        if ((w0 | w1 | w2) < 0) continue;
+        float invDepth = block.invDepth + (block.invDepthStep * i);
+        if (invDepth > depth[i]) {
+          depth[i] = invDepth;
+          mask |= 1u << i;
+        }
+      }
+      return mask;
+    }
+
+#ifdef TRIANGLE_STORE_X86_SIMD
+    __attribute__((target("avx2")))
+    unsigned depthTestAVX2(const PixelBlock& block, int lanes, float* depth) const {
+      __m256i lane = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+      // Sign bit set on the pixels outside any edge or past the end of the row
+      __m256i outside = _mm256_cmpgt_epi32(lane, _mm256_set1_epi32(lanes - 1));
+      for (int k=0; k<3; k++) {
+        __m256i w = _mm256_add_epi32(_mm256_set1_epi32(block.w[k]), _mm256_mullo_epi32(_mm256_set1_epi32(block.step[k]), lane));
+        outside = _mm256_or_si256(outside, w);
+      }
+      __m256i covered = _mm256_cmpgt_epi32(outside, _mm256_set1_epi32(-1));
+      if (_mm256_testz_si256(covered, covered)) return 0;
+
+      __m256 invDepth = _mm256_add_ps(_mm256_set1_ps(block.invDepth), _mm256_mul_ps(_mm256_set1_ps(block.invDepthStep), _mm256_cvtepi32_ps(lane)));
+      __m256 old = _mm256_maskload_ps(depth, covered);
+      __m256 pass = _mm256_and_ps(_mm256_cmp_ps(invDepth, old, _CMP_GT_OQ), _mm256_castsi256_ps(covered));
+      _mm256_maskstore_ps(depth, _mm256_castps_si256(pass), invDepth);
+      return _mm256_movemask_ps(pass);
+    }
+
+    __attribute__((target("avx2")))
+    void storeAVX2(uint32_t* dst, uint32_t value, unsigned mask) const {
+      __m256i bits = _mm256_setr_epi32(1, 2, 4, 8, 16, 32, 64, 128);
+      __m256i lanes = _mm256_cmpeq_epi32(_mm256_and_si256(_mm256_set1_epi32(mask), bits), bits);
+      _mm256_maskstore_epi32((int*)dst, lanes, _mm256_set1_epi32(value));
+    }
+
+    // Whole blocks only: the depths are blended and written back in full
+    __attribute__((target("sse4.2")))
+    unsigned depthTestSSE(const PixelBlock& block, float* depth) const {
+      unsigned mask = 0;
+      for (int half=0; half<2; half++) {
+        __m128i lane = _mm_setr_epi32(4 * half, (4 * half) + 1, (4 * half) + 2, (4 * half) + 3);
+        __m128i outside = _mm_setzero_si128();
+        for (int k=0; k<3; k++) {
+          __m128i w = _mm_add_epi32(_mm_set1_epi32(block.w[k]), _mm_mullo_epi32(_mm_set1_epi32(block.step[k]), lane));
+          outside = _mm_or_si128(outside, w);
+        }
+        __m128i covered = _mm_cmpgt_epi32(outside, _mm_set1_epi32(-1));
+        if (_mm_testz_si128(covered, covered)) continue;
+        __m128 invDepth = _mm_add_ps(_mm_set1_ps(block.invDepth), _mm_mul_ps(_mm_set1_ps(block.invDepthStep), _mm_cvtepi32_ps(lane)));
+        __m128 old = _mm_loadu_ps(depth + (4 * half));
+        __m128 pass = _mm_and_ps(_mm_cmpgt_ps(invDepth, old), _mm_castsi128_ps(covered));
+        _mm_storeu_ps(depth + (4 * half), _mm_blendv_ps(old, invDepth, pass));
+        mask |= _mm_movemask_ps(pass) << (4 * half);
+      }
+      return mask;
+    }
+#endif
+};
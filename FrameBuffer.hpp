@@ -0,0 +1,46 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+#include <algorithm>
+#include <iostream>
+
+// Off-screen ARGB pixel store that every view mode draws into. It doesn't
+// need SDL, so headless renders use it directly; with a window open, each
+// finished frame is copied across to the DrawingWindow to be presented.
+class FrameBuffer {
+  public:
+    std::vector<uint32_t> pixels;
+    int width = 0, height = 0;
+
+    FrameBuffer() {}
+
+    FrameBuffer(int w, int h) {
+      width = w;
+      height = h;
+      pixels.assign(width * height, 0);
+    }
+
+    void setPixelColour(int x, int y, uint32_t colour) {
+      if ((x<0) || (x>=width) || (y<0) || (y>=height)) {
+        std::cout << x << "," <<  y << " not on visible screen area" << std::endl;
+      }
+      else pixels[(y*width)+x] = colour;
+    }
+
+    uint32_t getPixelColour(int x, int y) {
+      if ((x<0) || (x>=width) || (y<0) || (y>=height)) {
+        std::cout << x << "," <<  y << " not on visible screen area" << std::endl;
+        return -1;
+      }
+      else return pixels[(y*width)+x];
+    }
+
+    void fill(uint32_t colour) {
+      std::fill(pixels.begin(), pixels.end(), colour);
+    }
+
+    void clearPixels() {
+      fill(0);
+    }
+};
@@ -1,25 +1,52 @@
 
 #include <string>
 #include <vector>
+#include "Mesh.hpp"
 
 class GObject {
   public:
     std::string name;
     Colour colour;
-    std::vector<ModelTriangle> faces;
+    Mesh mesh;
+    // Axis-aligned box around the mesh, for culling the whole object. Call
+    // updateBounds() whenever its vertices move.
+    glm::vec3 boundsLo = glm::vec3(0.0f), boundsHi = glm::vec3(0.0f);
+    // Set for closed meshes wound counter-clockwise (seen from outside),
+    // whose back faces are always hidden behind their front ones, so the
+    // rasteriser (and optionally rays) can skip them. Not for anything seen
+    // from both sides, like the Cornell box's walls.
+    bool cullBackFaces = false;
 
     GObject () {}
 
-    GObject (std::string n, Colour c, std::vector<ModelTriangle> fs) {
+    GObject (std::string n, Colour c, const std::vector<ModelTriangle>& fs) {
       name = n;
       colour = c;
-      faces = fs;
+      mesh = Mesh::fromTriangles(fs);
+      updateBounds();
+    }
+
+    GObject (std::string n, Colour c, Mesh m) {
+      name = n;
+      colour = c;
+      mesh = std::move(m);
+      updateBounds();
+    }
+
+    // Every vertex belongs to some face, so the faces' box is the vertices'
+    void updateBounds() {
+      if (mesh.vertices.empty()) return;
+      boundsLo = boundsHi = mesh.vertices[0];
+      for (uint i=0; i<mesh.vertices.size(); i++) {
+        boundsLo = glm::min(boundsLo, mesh.vertices[i]);
+        boundsHi = glm::max(boundsHi, mesh.vertices[i]);
+      }
     }
 
 };
 
 std::ostream& operator<<(std::ostream& os, const GObject& gobject)
 {
-    os << "GObject: name " << gobject.name << " colour " << gobject.colour << " num_faces " << gobject.faces.size() << endl;
+    os << "GObject: name " << gobject.name << " colour " << gobject.colour << " num_faces " << gobject.mesh.faceCount() << endl;
     return os;
 }
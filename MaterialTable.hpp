@@ -0,0 +1,78 @@
+#pragma once
+
+#include <vector>
+#include <unordered_map>
+#include <string>
+#include <mutex>
+#include <cstdint>
+#include <iostream>
+
+using namespace std;
+
+// A material's place in the MaterialTable
+typedef uint16_t MaterialId;
+
+// Every material the loaded scenes use (a name and a colour, as a Colour),
+// each kept once and referred to everywhere else by its id. Drawing only
+// needs a material's colour, packed as 0x00RRGGBB like the frame's pixels,
+// and a few flags worked out from its name when it's added, and those are
+// kept in arrays of their own, so nothing that runs per triangle or per
+// pixel touches a string. Materials are only ever added, so ids stay put
+// for as long as the program runs. Adding is safe from any thread, but
+// nothing may be added while a frame is being drawn.
+class MaterialTable {
+  public:
+    // The material's texture is stretched across each row rather than
+    // mapped by its texture coordinates (see drawFilledTriangle())
+    static constexpr uint8_t STRETCH_TEXTURE = 1;
+
+    static constexpr int MAX_MATERIALS = 1 << 16;
+
+    MaterialTable() {}
+
+    // The table every mesh's material ids refer to
+    static MaterialTable& shared() {
+      static MaterialTable table;
+      return table;
+    }
+
+    // The id of this material, adding it if it's new
+    MaterialId intern(const Colour& colour) {
+      uint32_t rgb = pack(colour);
+      lock_guard<mutex> lock(adding);
+      auto range = byColour.equal_range(rgb);
+      for (auto m = range.first; m != range.second; m++) {
+        if (entries[m->second].name == colour.name) return m->second;
+      }
+      if (size() == MAX_MATERIALS) {
+        cout << "More than " << MAX_MATERIALS << " materials; drawing " << colour.name << " as " << entries[0].name << endl;
+        return 0;
+      }
+      MaterialId id = size();
+      entries.push_back(colour);
+      packed.push_back(rgb);
+      flagBits.push_back((colour.name == "material_0") ? STRETCH_TEXTURE : 0);
+      byColour.insert({rgb, id});
+      return id;
+    }
+
+    // The whole material, for loading, saving and printing
+    const Colour& colour(MaterialId id) const { return entries[id]; }
+
+    uint32_t rgb(MaterialId id) const { return packed[id]; }
+
+    bool has(MaterialId id, uint8_t flag) const { return (flagBits[id] & flag) != 0; }
+
+    int size() const { return entries.size(); }
+
+    static uint32_t pack(const Colour& colour) { return (colour.red << 16) + (colour.green << 8) + colour.blue; }
+
+  private:
+    vector<Colour> entries;
+    vector<uint32_t> packed;
+    vector<uint8_t> flagBits;
+    // Ids by packed colour, to find a material again without comparing
+    // names against every other one
+    unordered_multimap<uint32_t, MaterialId> byColour;
+    mutex adding;
+};
@@ -0,0 +1,151 @@
+#pragma once
+
+#include <vector>
+#include <unordered_map>
+#include <cstdint>
+#include <cstring>
+#include <glm/glm.hpp>
+#include "MaterialTable.hpp"
+
+using namespace std;
+using namespace glm;
+
+// A set of triangles as an indexed mesh: each distinct vertex is stored once,
+// and each face is three 32-bit indices into them, with its material (an id
+// in MaterialTable::shared()) and texture in arrays of their own. Texture coordinates are
+// shared the same way, through a second index buffer that's only there if
+// some face is textured. Moving the mesh moves each shared vertex once, and
+// a face costs 18 bytes of indices and ids (30 if textured) plus its share
+// of the vertices, where a ModelTriangle is 120 bytes.
+class Mesh {
+  public:
+    vector<vec3> vertices;
+    // Three per face, into vertices
+    vector<uint32_t> indices;
+    // Each face's material
+    vector<MaterialId> faceMaterials;
+    // Each face's texture handle (see TextureRegistry), or -1 if none
+    vector<int32_t> faceTextures;
+    vector<vec2> textureVertices;
+    // Three per face, into textureVertices; empty if no face is textured.
+    // Untextured faces' entries mean nothing.
+    vector<uint32_t> textureIndices;
+
+    Mesh () {}
+
+    int faceCount() const { return faceMaterials.size(); }
+
+    vec3 vertex(int face, int k) const { return vertices[indices[(3 * face) + k]]; }
+
+    MaterialId material(int face) const { return faceMaterials[face]; }
+
+    const Colour& colour(int face) const { return MaterialTable::shared().colour(faceMaterials[face]); }
+
+    bool textured(int face) const { return faceTextures[face] != -1; }
+
+    vec2 textureVertex(int face, int k) const { return textureVertices[textureIndices[(3 * face) + k]]; }
+
+    // Appends a face, given indices of vertices (and texture vertices, if
+    // texture isn't -1) already added
+    void addFace(const uint32_t corners[3], MaterialId material, int32_t texture, const uint32_t textureCorners[3]) {
+      int face = faceCount();
+      indices.insert(indices.end(), corners, corners + 3);
+      faceMaterials.push_back(material);
+      faceTextures.push_back(texture);
+      // The first textured face fills in entries for the untextured ones
+      // before it
+      if (texture != -1 && textureIndices.size() < 3 * (size_t)face) textureIndices.resize(3 * face, 0);
+      if (texture != -1 || !textureIndices.empty()) {
+        for (int k = 0; k < 3; k++) textureIndices.push_back((texture != -1) ? textureCorners[k] : 0);
+      }
+    }
+
+    // Face f as a standalone ModelTriangle, for code that isn't in a hurry
+    ModelTriangle face(int f) const {
+      ModelTriangle triangle(vertex(f, 0), vertex(f, 1), vertex(f, 2), colour(f));
+      if (textured(f)) {
+        triangle.maybeTextureTriangle.emplace(TextureTriangle(faceTextures[f],
+          textureVertex(f, 0), textureVertex(f, 1), textureVertex(f, 2)));
+      }
+      return triangle;
+    }
+
+    // The same triangles, sharing every vertex (and texture vertex) that's
+    // exactly equal
+    static Mesh fromTriangles(const vector<ModelTriangle>& triangles) {
+      Mesh mesh;
+      unordered_map<VertexKey<3>, uint32_t, VertexKeyHash<3>> vertexIndex;
+      unordered_map<VertexKey<2>, uint32_t, VertexKeyHash<2>> textureIndex;
+      MaterialTable& materials = MaterialTable::shared();
+      // Runs of triangles usually share a material, so only look it up
+      // when it changes
+      const Colour* lastColour = nullptr;
+      MaterialId material = 0;
+      for (const ModelTriangle& triangle : triangles) {
+        uint32_t corners[3], textureCorners[3] = {0, 0, 0};
+        for (int k = 0; k < 3; k++) corners[k] = share(vertexIndex, mesh.vertices, triangle.vertices[k]);
+        int32_t texture = -1;
+        if (triangle.maybeTextureTriangle) {
+          const TextureTriangle& textureTriangle = triangle.maybeTextureTriangle.value();
+          texture = textureTriangle.texture;
+          for (int k = 0; k < 3; k++) {
+            textureCorners[k] = share(textureIndex, mesh.textureVertices, textureTriangle.vertices[k]);
+          }
+        }
+        const Colour& colour = triangle.colour;
+        if (lastColour == nullptr || colour.red != lastColour->red || colour.green != lastColour->green ||
+            colour.blue != lastColour->blue || colour.name != lastColour->name) {
+          material = materials.intern(colour);
+          lastColour = &colour;
+        }
+        mesh.addFace(corners, material, texture, textureCorners);
+      }
+      mesh.compact();
+      return mesh;
+    }
+
+    // Frees the spare capacity left by adding faces one at a time
+    void compact() {
+      vertices.shrink_to_fit();
+      indices.shrink_to_fit();
+      faceMaterials.shrink_to_fit();
+      faceTextures.shrink_to_fit();
+      textureVertices.shrink_to_fit();
+      textureIndices.shrink_to_fit();
+    }
+
+    // Heap bytes used, for comparing with other ways of storing triangles
+    size_t bytes() const {
+      return (vertices.capacity() * sizeof(vec3)) + (indices.capacity() * sizeof(uint32_t)) +
+             (faceMaterials.capacity() * sizeof(MaterialId)) +
+             (faceTextures.capacity() * sizeof(int32_t)) + (textureVertices.capacity() * sizeof(vec2)) +
+             (textureIndices.capacity() * sizeof(uint32_t));
+    }
+
+  private:
+    // A vertex's exact bits, so only identical vertices are shared
+    template <int N>
+    struct VertexKey {
+      uint32_t bits[N];
+
+      VertexKey(const float* v) { memcpy(bits, v, sizeof(bits)); }
+
+      bool operator==(const VertexKey& other) const { return memcmp(bits, other.bits, sizeof(bits)) == 0; }
+    };
+
+    template <int N>
+    struct VertexKeyHash {
+      size_t operator()(const VertexKey<N>& key) const {
+        size_t h = 0;
+        for (int k = 0; k < N; k++) h = (h * 0x9e3779b97f4a7c15ull) ^ key.bits[k];
+        return h ^ (h >> 29);
+      }
+    };
+
+    template <typename Index, typename Vertex>
+    static uint32_t share(Index& index, vector<Vertex>& values, const Vertex& value) {
+      auto inserted = index.insert({&value[0], (uint32_t)values.size()});
+      if (inserted.second) values.push_back(value);
+      return inserted.first->second;
+    }
+};
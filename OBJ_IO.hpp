@@ -8,36 +8,62 @@
 #include <tuple>
 #include <optional>
 #include "OBJ_Structure.hpp"
-#include "Texture.hpp"
+#include "OBJ_Parser.hpp"
+#include "TextureRegistry.hpp"
 
 using namespace std;
 using namespace glm;
 
 class OBJ_IO {
   public:
+    // Every file loadOBJ() has read (OBJs, MTLs and textures), in order,
+    // so a scene cache can tell when they change
+    vector<string> sourceFiles;
+
     OBJ_IO () {}
 
     // For clarity: each ModelTriangle (a triangle in 3D space) may get their
     // "filling" from a TextureTriangle (a triangle in 2D space).
 
-    tuple<vector<GObject>, optional<Texture>> loadOBJ(string filename) {
-      optional<Texture> maybeTexture;
+    // Its texture (if it has one) is loaded into textures, and the
+    // TextureTriangles refer to it by handle. With a pool, big files are
+    // parsed in chunks on its threads.
+    vector<GObject> loadOBJ(string filename, TextureRegistry& textures, ThreadPool* pool = nullptr) {
+      OBJ_Mesh mesh;
+      OBJ_Parser parser;
+      bool found = (pool != nullptr) ? parser.parseParallel(filename, mesh, *pool) : parser.parse(filename, mesh);
+      if (!found) {
+        cout << "File not found." << endl;
+        exit(1);
+      }
+      materialDict mtlDict;
+      string textureFilename;
+      if (!mesh.mtlLibFileName.empty()) tie(mtlDict, textureFilename) = loadMTL(mesh.mtlLibFileName);
+      int texture = -1;
+      if (!textureFilename.empty()) texture = textures.load(textureFilename);
+      sourceFiles.push_back(filename);
+      if (!mesh.mtlLibFileName.empty()) sourceFiles.push_back(mesh.mtlLibFileName);
+      if (!textureFilename.empty()) sourceFiles.push_back(textureFilename);
+      return mesh.toGObjects(mtlDict, texture);
+    }
+
+    // The original istream-based loader, which makes the same gobjects as
+    // loadOBJ() (it's kept to check the new one against) but much slower
+    vector<GObject> loadOBJReference(string filename, TextureRegistry& textures) {
       OBJ_Structure structure = loadOBJpass1(filename);
-      if (structure.textureFilename.empty())
-        maybeTexture = nullopt;
-      else maybeTexture.emplace(Texture(structure.textureFilename));
+      int texture = -1;
+      if (!structure.textureFilename.empty()) texture = textures.load(structure.textureFilename);
       //cout << structure << endl;
-      return make_tuple(structure.toGObjects(), maybeTexture);
+      return structure.toGObjects(texture);
     }
 
     std::vector<GObject> scale_additive(std::vector<GObject> gobjects) {
       float currentMinComponent = std::numeric_limits<float>::infinity();
       for (uint j=0; j<gobjects.size(); j++) {
-        for (uint i=0; i<gobjects.at(j).faces.size(); i++) {
-          for (int k=0; k<3; k++) {
-            float smallest = minComponent(gobjects.at(j).faces.at(i).vertices[k]);
-            if (smallest < currentMinComponent) currentMinComponent = smallest;
-          }
+        const vector<vec3>& vertices = gobjects.at(j).mesh.vertices;
+        for (uint i=0; i<vertices.size(); i++) {
+          float smallest = minComponent(vertices[i]);
+          if (smallest < currentMinComponent) currentMinComponent = smallest;
         }
       }
 
@@ -45,15 +71,11 @@ class OBJ_IO {
 
       for (uint j=0; j<gobjects.size(); j++) {
         //std::cout << "gobject " << gobjects.at(j).name << '\n';
-        for (uint i=0; i<gobjects.at(j).faces.size(); i++) {
-          for (int k=0; k<3; k++) {
-            glm::vec3 v = gobjects.at(j).faces.at(i).vertices[k];
-            v[0] += addFactor;
-            v[1] += addFactor;
-            v[2] += addFactor;
-            gobjects.at(j).faces.at(i).vertices[k] = v;
-            // std::cout << "NEW VERTEX: (" << v.x << ", " << v.y << ", " << v.z << ")\n";
-          }
+        vector<vec3>& vertices = gobjects.at(j).mesh.vertices;
+        for (uint i=0; i<vertices.size(); i++) {
+          vertices[i][0] += addFactor;
+          vertices[i][1] += addFactor;
+          vertices[i][2] += addFactor;
         }
       }
       return gobjects;
@@ -62,11 +84,10 @@ class OBJ_IO {
     std::vector<GObject> scale_multiplicative(int width, std::vector<GObject> gobjects) {
       float currentMaxComponent = -std::numeric_limits<float>::infinity();
       for (uint j=0; j<gobjects.size(); j++) {
-        for (uint i=0; i<gobjects.at(j).faces.size(); i++) {
-          for (int k=0; k<3; k++) {
-            float greatest = maxComponent(gobjects.at(j).faces.at(i).vertices[k]);
-            if (greatest > currentMaxComponent) currentMaxComponent = greatest;
-          }
+        const vector<vec3>& vertices = gobjects.at(j).mesh.vertices;
+        for (uint i=0; i<vertices.size(); i++) {
+          float greatest = maxComponent(vertices[i]);
+          if (greatest > currentMaxComponent) currentMaxComponent = greatest;
         }
       }
 
@@ -77,15 +98,11 @@ class OBJ_IO {
 
       for (uint j=0; j<gobjects.size(); j++) {
         //std::cout << "gobject " << gobjects.at(j).name << '\n';
-        for (uint i=0; i<gobjects.at(j).faces.size(); i++) {
-          for (int k=0; k<3; k++) {
-            glm::vec3 v = gobjects.at(j).faces.at(i).vertices[k];
-            v[0] *= multFactor;
-            v[1] *= multFactor;
-            v[2] *= multFactor;
-            gobjects.at(j).faces.at(i).vertices[k] = v;
-            //std::cout << "NEW VERTEX: (" << v.x << ", " << v.y << ", " << v.z << ")\n";
-          }
+        vector<vec3>& vertices = gobjects.at(j).mesh.vertices;
+        for (uint i=0; i<vertices.size(); i++) {
+          vertices[i][0] *= multFactor;
+          vertices[i][1] *= multFactor;
+          vertices[i][2] *= multFactor;
         }
       }
       //std::cout << "finished scaling" << '\n';
@@ -102,7 +119,7 @@ class OBJ_IO {
       return (lineString.empty() || lineString.front() == '#');
     }
 
-    faceData processFaceLine(istringstream& lineStream, OBJ_Structure structure) {
+    faceData processFaceLine(istringstream& lineStream, const OBJ_Structure& structure) {
       string faceTerm;
       vec3_int vindices;
       vec3_int tindices;
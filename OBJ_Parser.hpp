@@ -0,0 +1,440 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <algorithm>
+#include <charconv>
+#include <cstring>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "ThreadPool.hpp"
+
+using namespace std;
+using namespace glm;
+
+// A file mapped read-only into memory, for as long as this lives
+class MappedFile {
+  public:
+    const char* data = nullptr;
+    size_t size = 0;
+
+    MappedFile(const string& filename) {
+      int fd = open(filename.c_str(), O_RDONLY);
+      if (fd < 0) return;
+      opened = true;
+      struct stat info;
+      // An empty file can't be mapped, but is fine: there's nothing to read
+      if (fstat(fd, &info) == 0 && info.st_size > 0) {
+        void* mapping = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mapping == MAP_FAILED) opened = false;
+        else {
+          data = (const char*)mapping;
+          size = info.st_size;
+          madvise(mapping, size, MADV_SEQUENTIAL);
+        }
+      }
+      close(fd);
+    }
+
+    ~MappedFile() {
+      if (data != nullptr) munmap((void*)data, size);
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    bool ok() const { return opened; }
+
+  private:
+    bool opened = false;
+};
+
+// What the renderer uses from an OBJ file, in flat arrays rather than a map
+// of faces per object
+class OBJ_Mesh {
+  public:
+    string mtlLibFileName;
+    vector<vec3> vertices;
+    vector<vec2> textureVertices;
+    // Three corners per triangle: 0-based indices into vertices, and into
+    // textureVertices (or -1 where the face didn't give one)
+    vector<int> vertexIndices;
+    vector<int> textureIndices;
+    // Each triangle's object, as an index into objectNames, and each
+    // object's material (from its first usemtl; empty if it had none)
+    vector<int> triangleObjects;
+    vector<string> objectNames;
+    vector<string> objectMaterials;
+
+    OBJ_Mesh () {}
+
+    int triangleCount() const { return triangleObjects.size(); }
+
+    // The same gobjects OBJ_Structure::toGObjects() makes: one per object
+    // with faces, in order of name, each with its faces in file order. Each
+    // gobject's mesh has the vertices its faces use, in order of first use.
+    // Triangles get a TextureTriangle (using texture) if texture isn't -1
+    // and all their corners have texture vertices. Triangles whose corners
+    // aren't all real vertices are dropped.
+    vector<GObject> toGObjects(const materialDict& mtlDict, int texture) const {
+      int numObjects = objectNames.size();
+      vector<int> byName(numObjects);
+      for (int o = 0; o < numObjects; o++) byName[o] = o;
+      sort(byName.begin(), byName.end(), [&](int a, int b) { return objectNames[a] < objectNames[b]; });
+
+      // Bucket the triangles by object, keeping their order
+      vector<int> start(numObjects + 1, 0);
+      for (int t = 0; t < triangleCount(); t++) start[triangleObjects[t] + 1]++;
+      for (int o = 0; o < numObjects; o++) start[o + 1] += start[o];
+      vector<int> order(triangleCount());
+      vector<int> next(start.begin(), start.end() - 1);
+      for (int t = 0; t < triangleCount(); t++) order[next[triangleObjects[t]]++] = t;
+
+      vector<GObject> result;
+      int skipped = 0;
+      // Where each vertex went in the current object's mesh, or -1
+      vector<int> vertexSlot(vertices.size(), -1), textureSlot(textureVertices.size(), -1);
+      vector<int> addedVertices, addedTextureVertices;
+      for (int o : byName) {
+        if (start[o] == start[o + 1]) continue;
+        Colour colour = lookupColour(mtlDict, objectMaterials[o]);
+        Mesh mesh;
+        MaterialId material = MaterialTable::shared().intern(colour);
+        for (int k = start[o]; k < start[o + 1]; k++) {
+          const int* v = &vertexIndices[3 * order[k]];
+          const int* vt = &textureIndices[3 * order[k]];
+          if (!validIndices(v, vertices.size())) {
+            skipped++;
+            continue;
+          }
+          uint32_t corners[3], textureCorners[3] = {0, 0, 0};
+          for (int c = 0; c < 3; c++) corners[c] = localIndex(v[c], vertices, mesh.vertices, vertexSlot, addedVertices);
+          int32_t faceTexture = -1;
+          if (texture != -1 && validIndices(vt, textureVertices.size())) {
+            faceTexture = texture;
+            for (int c = 0; c < 3; c++) {
+              textureCorners[c] = localIndex(vt[c], textureVertices, mesh.textureVertices, textureSlot, addedTextureVertices);
+            }
+          }
+          mesh.addFace(corners, material, faceTexture, textureCorners);
+        }
+        for (int g : addedVertices) vertexSlot[g] = -1;
+        for (int g : addedTextureVertices) textureSlot[g] = -1;
+        addedVertices.clear();
+        addedTextureVertices.clear();
+        mesh.compact();
+        result.push_back(GObject(objectNames[o], colour, std::move(mesh)));
+      }
+      if (skipped > 0) cout << "Skipped " << skipped << " faces with missing vertices" << endl;
+      return result;
+    }
+
+  private:
+    // Where vertex g of all is in local, adding it the first time it's used
+    template <typename Vertex>
+    static uint32_t localIndex(int g, const vector<Vertex>& all, vector<Vertex>& local, vector<int>& slot, vector<int>& added) {
+      if (slot[g] == -1) {
+        slot[g] = local.size();
+        local.push_back(all[g]);
+        added.push_back(g);
+      }
+      return slot[g];
+    }
+
+    static bool validIndices(const int* indices, size_t count) {
+      for (int k = 0; k < 3; k++) {
+        if (indices[k] < 0 || indices[k] >= (int)count) return false;
+      }
+      return true;
+    }
+
+    static Colour lookupColour(const materialDict& mtlDict, const string& matName) {
+      auto found = mtlDict.find(matName);
+      if (matName.empty() || found == mtlDict.end()) return Colour(0,0,0);
+      return found->second;
+    }
+};
+
+// Reads OBJ files straight from a memory mapping, a line at a time without
+// copying them, with numbers converted by from_chars. Handles v, vt, f, o,
+// usemtl and mtllib lines and skips the rest. Faces with more than three
+// corners are split into a fan of triangles, and negative (relative)
+// indices count back from the last vertex so far.
+class OBJ_Parser {
+  public:
+    OBJ_Parser () {}
+
+    // Returns false if the file can't be read
+    bool parse(const string& filename, OBJ_Mesh& mesh) {
+      MappedFile file(filename);
+      if (!file.ok()) return false;
+      parse(file.data, file.data + file.size, mesh);
+      return true;
+    }
+
+    // Parses the OBJ text in [begin, end) into mesh, which should be empty
+    void parse(const char* begin, const char* end, OBJ_Mesh& mesh) {
+      currentObject = objectId(mesh, "loose");
+      parseLines(begin, end, mesh);
+    }
+
+    // The same as parse(filename, mesh), but with the file split into chunks
+    // at line boundaries, a chunk per task on pool. Each chunk is parsed as
+    // if it were a file of its own, except that it starts in whatever object
+    // the chunk before it ends in (which isn't known yet), and relative
+    // indices count back from the chunk's own vertices. A merge pass then
+    // appends the chunks in order, joining up objects and materials by name
+    // and offsetting the relative indices by the vertices before the chunk.
+    bool parseParallel(const string& filename, OBJ_Mesh& mesh, ThreadPool& pool) {
+      MappedFile file(filename);
+      if (!file.ok()) return false;
+      // A few chunks per thread so they balance, but none so small that
+      // merging costs more than parsing
+      int chunks = (pool.size() == 1) ? 1 : std::min(pool.size() * 4, (int)(file.size / MIN_CHUNK_BYTES));
+      if (chunks <= 1) {
+        parse(file.data, file.data + file.size, mesh);
+        return true;
+      }
+
+      vector<const char*> bounds(chunks + 1);
+      bounds[0] = file.data;
+      bounds[chunks] = file.data + file.size;
+      for (int c = 1; c < chunks; c++) {
+        const char* p = std::max(file.data + ((file.size * c) / chunks), bounds[c - 1]);
+        const char* lineEnd = (const char*)memchr(p, '\n', bounds[chunks] - p);
+        bounds[c] = (lineEnd == nullptr) ? bounds[chunks] : lineEnd + 1;
+      }
+
+      vector<OBJ_Parser> parsers(chunks);
+      vector<OBJ_Mesh> parts(chunks);
+      pool.run(chunks, [&](int c) {
+        if (c == 0) parsers[c].parse(bounds[c], bounds[c + 1], parts[c]);
+        else parsers[c].parseContinuation(bounds[c], bounds[c + 1], parts[c]);
+      });
+      merge(parsers, parts, mesh, pool);
+      return true;
+    }
+
+  private:
+    static constexpr size_t MIN_CHUNK_BYTES = 1 << 20;
+
+    // Which object the lines being read belong to
+    int currentObject = 0;
+    // Scratch space for the corners of the face being read, and whether
+    // each one's index was relative
+    vector<int> cornerVertices, cornerTextures;
+    vector<char> cornerVertexRelative, cornerTextureRelative;
+    unordered_map<string, int> objectIds;
+    // Where in mesh.vertexIndices (and textureIndices) relative indices
+    // went, which in a chunk need the vertices before it adding on
+    vector<int> relativeVertexCorners, relativeTextureCorners;
+
+    // Parses a chunk that starts partway through a file. Object 0 stands
+    // for whichever object the file was in at that point; it has no name
+    // here, so an "o" line naming that object makes another object, which
+    // merge() joins back up with it.
+    void parseContinuation(const char* begin, const char* end, OBJ_Mesh& mesh) {
+      mesh.objectNames.push_back("");
+      mesh.objectMaterials.push_back("");
+      currentObject = 0;
+      parseLines(begin, end, mesh);
+    }
+
+    void parseLines(const char* begin, const char* end, OBJ_Mesh& mesh) {
+      const char* p = begin;
+      while (p < end) {
+        const char* lineEnd = (const char*)memchr(p, '\n', end - p);
+        if (lineEnd == nullptr) lineEnd = end;
+        parseLine(p, lineEnd, mesh);
+        p = lineEnd + 1;
+      }
+    }
+
+    // Appends the chunks in parts (parsed by parsers) to mesh in order. The
+    // objects and where each chunk's arrays go are worked out first, in
+    // order; then the chunks are copied in and their indices fixed up in
+    // parallel.
+    static void merge(vector<OBJ_Parser>& parsers, vector<OBJ_Mesh>& parts, OBJ_Mesh& mesh, ThreadPool& pool) {
+      int chunks = parts.size();
+      vector<vector<int>> objectMaps(chunks);
+      vector<size_t> vertexBase(chunks + 1, 0), textureBase(chunks + 1, 0), triangleBase(chunks + 1, 0);
+
+      unordered_map<string, int> ids;
+      int object = -1;
+      for (int c = 0; c < chunks; c++) {
+        const OBJ_Mesh& part = parts[c];
+        for (int o = 0; o < (int)part.objectNames.size(); o++) {
+          if (c > 0 && o == 0) objectMaps[c].push_back(object);
+          else {
+            auto inserted = ids.insert({part.objectNames[o], (int)mesh.objectNames.size()});
+            if (inserted.second) {
+              mesh.objectNames.push_back(part.objectNames[o]);
+              mesh.objectMaterials.push_back("");
+            }
+            objectMaps[c].push_back(inserted.first->second);
+          }
+          // Chunks come in file order, so the first usemtl still wins
+          string& material = mesh.objectMaterials[objectMaps[c][o]];
+          if (material.empty()) material = part.objectMaterials[o];
+        }
+        object = objectMaps[c][parsers[c].currentObject];
+        if (!part.mtlLibFileName.empty()) mesh.mtlLibFileName = part.mtlLibFileName;
+        vertexBase[c + 1] = vertexBase[c] + part.vertices.size();
+        textureBase[c + 1] = textureBase[c] + part.textureVertices.size();
+        triangleBase[c + 1] = triangleBase[c] + part.triangleCount();
+      }
+
+      mesh.vertices.resize(vertexBase[chunks]);
+      mesh.textureVertices.resize(textureBase[chunks]);
+      mesh.vertexIndices.resize(3 * triangleBase[chunks]);
+      mesh.textureIndices.resize(3 * triangleBase[chunks]);
+      mesh.triangleObjects.resize(triangleBase[chunks]);
+      pool.run(chunks, [&](int c) {
+        OBJ_Mesh& part = parts[c];
+        std::copy(part.vertices.begin(), part.vertices.end(), mesh.vertices.begin() + vertexBase[c]);
+        std::copy(part.textureVertices.begin(), part.textureVertices.end(), mesh.textureVertices.begin() + textureBase[c]);
+        int* vertexIndices = &mesh.vertexIndices[3 * triangleBase[c]];
+        int* textureIndices = &mesh.textureIndices[3 * triangleBase[c]];
+        std::copy(part.vertexIndices.begin(), part.vertexIndices.end(), vertexIndices);
+        std::copy(part.textureIndices.begin(), part.textureIndices.end(), textureIndices);
+        for (int corner : parsers[c].relativeVertexCorners) vertexIndices[corner] += vertexBase[c];
+        for (int corner : parsers[c].relativeTextureCorners) textureIndices[corner] += textureBase[c];
+        for (int t = 0; t < part.triangleCount(); t++) {
+          mesh.triangleObjects[triangleBase[c] + t] = objectMaps[c][part.triangleObjects[t]];
+        }
+        // Free each chunk as soon as it's been copied
+        part = OBJ_Mesh();
+      });
+    }
+
+    static bool isSpace(char c) {
+      return c == ' ' || c == '\t' || c == '\r';
+    }
+
+    static const char* skipSpaces(const char* p, const char* end) {
+      while (p < end && isSpace(*p)) p++;
+      return p;
+    }
+
+    // The next whitespace-delimited word, moving p past it
+    static string_view word(const char*& p, const char* end) {
+      p = skipSpaces(p, end);
+      const char* start = p;
+      while (p < end && !isSpace(*p)) p++;
+      return string_view(start, p - start);
+    }
+
+    // Reads a float (which from_chars won't do with a leading '+'); leaves
+    // value alone and p where it was if there isn't one
+    static bool number(const char*& p, const char* end, float& value) {
+      const char* start = skipSpaces(p, end);
+      if (start < end && *start == '+') start++;
+      auto result = from_chars(start, end, value);
+      if (result.ec != errc()) return false;
+      p = result.ptr;
+      return true;
+    }
+
+    static bool number(const char*& p, const char* end, int& value) {
+      if (p < end && *p == '+') p++;
+      auto result = from_chars(p, end, value);
+      if (result.ec != errc()) return false;
+      p = result.ptr;
+      return true;
+    }
+
+    int objectId(OBJ_Mesh& mesh, string_view name) {
+      string key(name);
+      auto found = objectIds.find(key);
+      if (found != objectIds.end()) return found->second;
+      int id = mesh.objectNames.size();
+      objectIds.insert({key, id});
+      mesh.objectNames.push_back(key);
+      mesh.objectMaterials.push_back("");
+      return id;
+    }
+
+    // OBJ indices count from 1, or back from the end if negative
+    static int resolveIndex(int index, int count) {
+      return (index < 0) ? count + index : index - 1;
+    }
+
+    void parseLine(const char* p, const char* end, OBJ_Mesh& mesh) {
+      string_view keyword = word(p, end);
+      if (keyword == "v") {
+        vec3 vertex(0.0f);
+        number(p, end, vertex[0]);
+        number(p, end, vertex[1]);
+        number(p, end, vertex[2]);
+        mesh.vertices.push_back(vertex);
+      }
+      else if (keyword == "vt") {
+        float a = 0.0f, b = 0.0f;
+        number(p, end, a);
+        number(p, end, b);
+        vec2 textureVertex(a, b);
+        // Normalise texture vertices in case of erroneous .objs
+        if (a > 1 || a < 0) {
+          textureVertex[0] = abs(a);
+          if (textureVertex[0] > 1) textureVertex[0] = 1 / textureVertex[0];
+        }
+        if (b > 1 || b < 0) {
+          textureVertex[1] = abs(b);
+          if (textureVertex[1] > 1) textureVertex[1] = 1 / textureVertex[1];
+        }
+        mesh.textureVertices.push_back(textureVertex);
+      }
+      else if (keyword == "f") parseFace(p, end, mesh);
+      else if (keyword == "o") {
+        // A bare "o" leaves the object as it was
+        string_view name = word(p, end);
+        if (!name.empty()) currentObject = objectId(mesh, name);
+      }
+      else if (keyword == "usemtl") {
+        // An object keeps the first material it's given
+        string& material = mesh.objectMaterials[currentObject];
+        if (material.empty()) material = string(word(p, end));
+      }
+      else if (keyword == "mtllib") mesh.mtlLibFileName = string(word(p, end));
+    }
+
+    // Corners are "v", "v/vt", "v//vn" or "v/vt/vn"; normals are ignored
+    void parseFace(const char* p, const char* end, OBJ_Mesh& mesh) {
+      cornerVertices.clear();
+      cornerTextures.clear();
+      cornerVertexRelative.clear();
+      cornerTextureRelative.clear();
+      while (true) {
+        p = skipSpaces(p, end);
+        int v, vt = 0;
+        if (!number(p, end, v)) break;
+        if (p < end && *p == '/') {
+          p++;
+          if (!number(p, end, vt)) vt = 0;
+          if (p < end && *p == '/') {
+            p++;
+            int vn;
+            number(p, end, vn);
+          }
+        }
+        while (p < end && !isSpace(*p)) p++;
+        cornerVertices.push_back(resolveIndex(v, mesh.vertices.size()));
+        cornerTextures.push_back((vt == 0) ? -1 : resolveIndex(vt, mesh.textureVertices.size()));
+        cornerVertexRelative.push_back(v < 0);
+        cornerTextureRelative.push_back(vt < 0);
+      }
+      for (int k = 1; k + 1 < (int)cornerVertices.size(); k++) {
+        int corners[3] = {0, k, k + 1};
+        for (int c : corners) {
+          if (cornerVertexRelative[c]) relativeVertexCorners.push_back(mesh.vertexIndices.size());
+          if (cornerTextureRelative[c]) relativeTextureCorners.push_back(mesh.textureIndices.size());
+          mesh.vertexIndices.push_back(cornerVertices[c]);
+          mesh.textureIndices.push_back(cornerTextures[c]);
+        }
+        mesh.triangleObjects.push_back(currentObject);
+      }
+    }
+};
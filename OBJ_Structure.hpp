@@ -1,5 +1,6 @@
 
 #include <unordered_map>
+#include <array>
 #include <map>
 #include <tuple>
 #include <optional>
@@ -47,8 +48,9 @@ class OBJ_Structure {
     // Loop through faceDict's key (i.e. all the objects in the scene, incl.
     // "loose") and build a TextureTriangle by referencing the array,
     // and then a ModelTriangle using the other array, and then make a gobject
-    // and add it to the vector.
-    vector<GObject> toGObjects() {
+    // and add it to the vector. The TextureTriangles all use the texture with
+    // handle texture (the one named by textureFilename).
+    vector<GObject> toGObjects(int texture) {
       vector<GObject> result;
 
       string objName = "dummy";
@@ -80,7 +82,7 @@ class OBJ_Structure {
         // If we have texture vertices, make them into a TextureTriangle
         if (get<1>(face)) {
           tindices = get<1>(face).value();
-          ttriangle = TextureTriangle(textureFilename,
+          ttriangle = TextureTriangle(texture,
             allTextureVertices.at(tindices[0]),
             allTextureVertices.at(tindices[1]),
             allTextureVertices.at(tindices[2]));
@@ -0,0 +1,189 @@
+#pragma once
+
+#include <chrono>
+#include <atomic>
+#include <mutex>
+#include <vector>
+#include <string>
+#include <cstdio>
+#include <cstdint>
+
+using namespace std;
+
+// Heap allocations made since the program started. Only counted in builds
+// with COUNT_ALLOCATIONS defined (make allocations), which replace the
+// global allocation functions in Renderer.cpp; otherwise it stays 0 and
+// allocation costs nothing extra.
+inline atomic<uint64_t> heapAllocations{0};
+
+// The parts of a frame the profiler times. Stages nested inside others (e.g.
+// depth tests inside triangle fills) are counted in both.
+enum ProfileStage {
+  STAGE_FRAME,
+  STAGE_RASTER_PASS,
+  STAGE_PROJECTION,
+  STAGE_RASTER_TILE,
+  STAGE_TRIANGLE_FILL,
+  STAGE_TEXTURE_LOOKUP,
+  STAGE_DEPTH_TEST,
+  STAGE_BVH_BUILD,
+  STAGE_RAY_PASS,
+  STAGE_RAY_TILE,
+  STAGE_PRIMARY_RAYS,
+  STAGE_SHADOW_RAYS,
+  STAGE_WRITE_PPM,
+  STAGE_RENDER_FRAME,
+  NUM_PROFILE_STAGES
+};
+
+// Per-frame stage timer. While a frame is open (between beginFrame() and
+// endFrame()) every ProfileScope adds its time to its stage's total, and the
+// coarser stages are also kept as individual events for a Chrome trace
+// (chrome://tracing or ui.perfetto.dev). Per-pixel stages would swamp the
+// trace, so they only appear as per-frame totals. When disabled a scope
+// costs a single branch.
+class Profiler {
+  public:
+    bool enabled = false;
+
+    Profiler() {}
+
+    void beginFrame() {
+      frameOpen = false;
+      if (!enabled) return;
+      for (int s=0; s<NUM_PROFILE_STAGES; s++) {
+        nanoseconds[s] = 0;
+        calls[s] = 0;
+      }
+      events.clear();
+      frameAllocations = heapAllocations.load(memory_order_relaxed);
+      frameStart = chrono::steady_clock::now();
+      frameOpen = true;
+    }
+
+    // Closes the frame, prints where its time went and, if traceFile isn't
+    // empty, writes the frame's trace there
+    void endFrame(int frameNumber, string traceFile) {
+      if (!frameOpen) return;
+      frameOpen = false;
+      auto end = chrono::steady_clock::now();
+      record(STAGE_FRAME, frameStart, end);
+      frameAllocations = heapAllocations.load(memory_order_relaxed) - frameAllocations;
+      printSummary(frameNumber);
+      if (!traceFile.empty()) writeTrace(traceFile, frameNumber);
+    }
+
+    bool recording() const { return frameOpen.load(memory_order_relaxed); }
+
+    void record(ProfileStage stage, chrono::steady_clock::time_point start, chrono::steady_clock::time_point end) {
+      uint64_t ns = chrono::duration_cast<chrono::nanoseconds>(end - start).count();
+      nanoseconds[stage].fetch_add(ns, memory_order_relaxed);
+      calls[stage].fetch_add(1, memory_order_relaxed);
+      if (!traced[stage]) return;
+      TraceEvent event;
+      event.stage = stage;
+      event.thread = threadNumber();
+      event.start = chrono::duration_cast<chrono::nanoseconds>(start - frameStart).count();
+      event.duration = ns;
+      lock_guard<mutex> lock(eventsLock);
+      events.push_back(event);
+    }
+
+  private:
+    struct TraceEvent {
+      ProfileStage stage;
+      int thread;
+      uint64_t start, duration;
+    };
+
+    const char* names[NUM_PROFILE_STAGES] = {
+      "frame", "raster pass", "projection", "raster tile", "triangle fill", "texture lookup", "depth test",
+      "bvh build", "ray pass", "ray tile", "primary rays", "shadow rays", "writePPM", "renderFrame"
+    };
+    // How deep each stage usually sits, for indenting the summary
+    const int depth[NUM_PROFILE_STAGES] = {0, 1, 2, 2, 3, 4, 4, 1, 1, 2, 3, 3, 1, 1};
+    const bool traced[NUM_PROFILE_STAGES] = {
+      true, true, true, true, true, false, false, true, true, true, false, false, true, true
+    };
+
+    // Read by scopes on the thread pool's workers too
+    atomic<bool> frameOpen{false};
+    chrono::steady_clock::time_point frameStart;
+    // Heap allocations when the frame began, then how many it made
+    uint64_t frameAllocations = 0;
+    atomic<uint64_t> nanoseconds[NUM_PROFILE_STAGES];
+    atomic<uint64_t> calls[NUM_PROFILE_STAGES];
+    mutex eventsLock;
+    vector<TraceEvent> events;
+
+    // Small stable numbers for the trace's thread rows, in order of first use
+    static int threadNumber() {
+      static atomic<int> nextThread{0};
+      thread_local int number = nextThread++;
+      return number;
+    }
+
+    void printSummary(int frameNumber) {
+      double frameMs = nanoseconds[STAGE_FRAME] / 1.0e6;
+      printf("Profile of frame %d (%.2f ms):\n", frameNumber, frameMs);
+      printf("  %-22s %10s %10s %7s\n", "stage", "calls", "total_ms", "frame%");
+      for (int s=0; s<NUM_PROFILE_STAGES; s++) {
+        if (calls[s] == 0) continue;
+        double ms = nanoseconds[s] / 1.0e6;
+        string name = string(2 * depth[s], ' ') + names[s];
+        printf("  %-22s %10lu %10.2f %6.1f%%\n", name.c_str(), (unsigned long)calls[s], ms, (100.0 * ms) / frameMs);
+      }
+#ifdef COUNT_ALLOCATIONS
+      printf("  heap allocations: %lu\n", (unsigned long)frameAllocations);
+#endif
+      printf("  (stages on worker threads can add up to more than the frame)\n");
+    }
+
+    void writeTrace(string traceFile, int frameNumber) {
+      FILE* f = fopen(traceFile.c_str(), "w");
+      if (f == NULL) {
+        printf("Could not write trace %s\n", traceFile.c_str());
+        return;
+      }
+      fprintf(f, "{\"traceEvents\": [\n");
+      for (uint i=0; i<events.size(); i++) {
+        fprintf(f, "  {\"name\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": %d, \"ts\": %.3f, \"dur\": %.3f},\n",
+                names[events[i].stage], events[i].thread, events[i].start / 1000.0, events[i].duration / 1000.0);
+      }
+      // The per-pixel stages, as totals at the end of the frame
+      double frameEnd = nanoseconds[STAGE_FRAME] / 1000.0;
+      fprintf(f, "  {\"name\": \"per-pixel stage totals (ms)\", \"ph\": \"C\", \"pid\": 1, \"ts\": %.3f, \"args\": {", frameEnd);
+      bool first = true;
+      for (int s=0; s<NUM_PROFILE_STAGES; s++) {
+        if (traced[s]) continue;
+        fprintf(f, "%s\"%s\": %.3f", first ? "" : ", ", names[s], nanoseconds[s] / 1.0e6);
+        first = false;
+      }
+      fprintf(f, "}}\n], \"displayTimeUnit\": \"ms\", \"otherData\": {\"frame\": %d}}\n", frameNumber);
+      fclose(f);
+      printf("  trace written to %s\n", traceFile.c_str());
+    }
+};
+
+// Times from construction to destruction as one call of the given stage.
+// Does nothing unless the profiler was recording a frame when it started.
+class ProfileScope {
+  public:
+    ProfileScope(Profiler& p, ProfileStage s) : profiler(p), stage(s) {
+      active = profiler.recording();
+      if (active) start = chrono::steady_clock::now();
+    }
+
+    ~ProfileScope() {
+      if (active) profiler.record(stage, start, chrono::steady_clock::now());
+    }
+
+    ProfileScope(const ProfileScope&) = delete;
+    ProfileScope& operator=(const ProfileScope&) = delete;
+
+  private:
+    Profiler& profiler;
+    ProfileStage stage;
+    bool active;
+    chrono::steady_clock::time_point start;
+};
@@ -1,6 +1,8 @@
 #include <ModelTriangle.h>
 #include <CanvasTriangle.h>
+#ifndef HEADLESS
 #include <DrawingWindow.h>
+#endif
 #include <RayTriangleIntersection.h>
 #include <Utils.h>
 #include <glm/glm.hpp>
@@ -14,55 +16,165 @@
 #include <filesystem>
 #include <tuple>
 #include <optional>
+#include <chrono>
 
 #include "Texture.hpp"
+#include "TextureRegistry.hpp"
+#include "MaterialTable.hpp"
 #include "GObject.hpp"
 #include "OBJ_IO.hpp"
 #include "Camera.hpp"
 #include "DepthBuffer.hpp"
 #include "Light.hpp"
+#include "BVH.hpp"
+#include "SceneCache.hpp"
+#include "ThreadPool.hpp"
+#include "FrameBuffer.hpp"
+#include "VisibilityBuffer.hpp"
+#include "Profiler.hpp"
+#include "BlockRaster.hpp"
+#include "TileBins.hpp"
+#include "AttributeInterpolator.hpp"
 
 using namespace std;
 using namespace glm;
 
 namespace fs = std::filesystem;
 
+#ifdef COUNT_ALLOCATIONS
+// Every form of operator new counts into heapAllocations, for --profile to
+// say how many a frame makes. They all allocate with malloc() or
+// aligned_alloc(), so every form of delete frees with free(). They're kept
+// opaque to the optimiser so it never sees malloc() paired with delete.
+__attribute__((noipa)) void* countedAllocation(size_t bytes, size_t alignment, bool nothrow) {
+  heapAllocations.fetch_add(1, memory_order_relaxed);
+  if (bytes == 0) bytes = 1;
+  void* p;
+  if (alignment <= alignof(max_align_t)) p = malloc(bytes);
+  else p = aligned_alloc(alignment, ((bytes + alignment - 1) / alignment) * alignment);
+  if (p == nullptr && !nothrow) throw bad_alloc();
+  return p;
+}
+
+void* operator new(size_t n) { return countedAllocation(n, 0, false); }
+void* operator new[](size_t n) { return countedAllocation(n, 0, false); }
+void* operator new(size_t n, const nothrow_t&) noexcept { return countedAllocation(n, 0, true); }
+void* operator new[](size_t n, const nothrow_t&) noexcept { return countedAllocation(n, 0, true); }
+void* operator new(size_t n, align_val_t a) { return countedAllocation(n, (size_t)a, false); }
+void* operator new[](size_t n, align_val_t a) { return countedAllocation(n, (size_t)a, false); }
+void* operator new(size_t n, align_val_t a, const nothrow_t&) noexcept { return countedAllocation(n, (size_t)a, true); }
+void* operator new[](size_t n, align_val_t a, const nothrow_t&) noexcept { return countedAllocation(n, (size_t)a, true); }
+
+__attribute__((noipa)) void countedFree(void* p) noexcept { free(p); }
+
+void operator delete(void* p) noexcept { countedFree(p); }
+void operator delete[](void* p) noexcept { countedFree(p); }
+void operator delete(void* p, size_t) noexcept { countedFree(p); }
+void operator delete[](void* p, size_t) noexcept { countedFree(p); }
+void operator delete(void* p, const nothrow_t&) noexcept { countedFree(p); }
+void operator delete[](void* p, const nothrow_t&) noexcept { countedFree(p); }
+void operator delete(void* p, align_val_t) noexcept { countedFree(p); }
+void operator delete[](void* p, align_val_t) noexcept { countedFree(p); }
+void operator delete(void* p, size_t, align_val_t) noexcept { countedFree(p); }
+void operator delete[](void* p, size_t, align_val_t) noexcept { countedFree(p); }
+void operator delete(void* p, align_val_t, const nothrow_t&) noexcept { countedFree(p); }
+void operator delete[](void* p, align_val_t, const nothrow_t&) noexcept { countedFree(p); }
+#endif
+
 // Definitions
 // ---
-#define WIDTH 640
-#define HEIGHT 480
+// The scene, camera focal length and teapot scale were all tuned for a
+// 640x480 window. Other resolutions show the same view, just sampled more or
+// less finely.
+#define REFERENCE_WIDTH 640
+#define REFERENCE_HEIGHT 480
+
+// Raytraced frames are split into square tiles of this many pixels a side,
+// which the thread pool hands out to its workers
+#define TILE_SIZE 16
+
+// Rasterised frames are split into bigger tiles, each drawn by one worker
+// against its own copy of that tile's depth buffer. A multiple of
+// BlockRaster::WIDTH, so tiles don't split blocks,
+#define RASTER_TILE_SIZE 64
+// and the same size as the depth buffer's tiles, so that each worker only
+// touches its own tile's dirty flag
+static_assert(RASTER_TILE_SIZE == DepthBuffer::CLEAR_TILE_SIZE, "raster tiles must match depth buffer tiles");
+// Triangles each task projects and bins before the tiles are drawn
+#define BIN_TASK_SIZE 256
+
+// Geometry nearer the camera than this, along its view direction, is
+// clipped off before projection (world units)
+#define NEAR_PLANE 1.0f
+
+// How far short of the shaded point shadow rays stop, in world units
+#define SHADOW_EPSILON 0.01f
 
 #define SCREENSHOT_DIR "./screenies/"
 #define SCREENSHOT_SUFFIX ".ppm"
 
+// Where loaded scenes are saved, so later runs can skip loading them
+#define SCENE_CACHE_DIR "./cache/"
+
 fs::path screenshotDir;
 
 Colour COLOURS[] = {Colour(255, 0, 0), Colour(0, 255, 0), Colour(0, 0, 255)};
 Colour WHITE = Colour(255, 255, 255);
 Colour BLACK = Colour(0, 0, 0);
 
-typedef enum {WIRE, RASTER, RAY} View_mode;
-typedef enum {WINDOW, TEXTURE} Draw_buf;
+typedef enum {WIRE, RASTER, RAY, HYBRID} View_mode;
+typedef enum {WINDOW, TEXTURE, VISIBILITY} Draw_buf;
 // Global Object Declarations
 // ---
 
 OBJ_IO obj_io;
+SceneCache sceneCache(SCENE_CACHE_DIR);
+// Cleared by --no-cache, to always load scenes from their OBJ files
+bool useSceneCache = true;
 std::vector<GObject> gobjects;
+FrameBuffer framebuffer;
+#ifndef HEADLESS
 DrawingWindow window;
+#endif
 
-uint32_t *texture_buffer;
+// Output resolution; set with setResolution() (e.g. from --size), which
+// resizes every per-pixel buffer to match
+int screenWidth = REFERENCE_WIDTH;
+int screenHeight = REFERENCE_HEIGHT;
 
-std::vector<Texture> textures;
-//Texture logoTexture;
-//Texture jamdyTexture;
+std::vector<uint32_t> texture_buffer;
+VisibilityBuffer visbuf;
+
+TextureRegistry textures;
+// Every material any mesh uses; triangles carry their ids
+MaterialTable& materials = MaterialTable::shared();
+// How the rasteriser samples textures; set with --filter or the M key
+TextureFilter textureFilter = FILTER_NEAREST;
 
 DepthBuffer depthbuf;
+BlockRaster blockRaster;
 Camera camera;
 View_mode current_mode;
 Draw_buf buf_mode;
 Light light;
+BVH bvh;
+// Set whenever gobject geometry moves, so the BVH is rebuilt before the next
+// raytraced frame
+bool sceneChanged = true;
+// Store index of the triangle being drawn as a wireframe, for the visibility
+// buffer
+int rasterTriangle = -1;
+// The frame's projected triangles, in scene order, and which overlap each
+// raster tile
+std::vector<CanvasTriangle> projectedTriangles;
+TileBins tileBins;
+// Triangles the last filled raster pass skipped as back-facing
+atomic<unsigned long> rasterBackFacesCulled{0};
 bool animating = false;
 
+ThreadPool pool;
+Profiler profiler;
+
 int number_of_AA_samples = 1;
 int frame_no = 0;
 // Simple Helper Functions
@@ -72,12 +184,16 @@ float min(float A, float B) { if (A < B) return A; return B; }
 int modulo(int x, int y) { if (y == 0) return x; return ((x % y) + x) % y; }
 bool comparator(CanvasPoint p1, CanvasPoint p2) { return (p1.y < p2.y); }
 void printVec3(vec3 v) { cout << "(" << v.x << ", " << v.y << ", " << v.z << ")\n"; }
-bool isLight(GObject gobj) { return (gobj.name == "light"); }
+bool isLight(const GObject& gobj) { return (gobj.name == "light"); }
 glm::mat3 rotMatX(float angle) { return mat3(1,0,0, 0,cos(angle),-sin(angle), 0,sin(angle),cos(angle)); }
 glm::mat3 rotMatY(float angle) { return mat3(cos(angle),0,sin(angle), 0,1,0, -sin(angle),0,cos(angle)); }
 glm::mat3 rotMatZ(float angle) { return mat3(cos(angle),-sin(angle),0, sin(angle),cos(angle),0, 0,0,1); }
 float deg2rad(float deg) { return (deg * M_PI) / 180; }
 
+double millisecondsSince(chrono::steady_clock::time_point start) {
+  return chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+}
+
 void printMat3(mat3 m) {
   printVec3(m[0]);
   printVec3(m[1]);
@@ -98,34 +214,57 @@ string getDateTimeString() {
   return string(buf);
 }
 
-void writePPM() {
-  std::string frame = std::string(5 - to_string(frame_no).length(), '0') + to_string(frame_no);
-  fs::path screenshotName = fs::path(frame + SCREENSHOT_SUFFIX);
-  fs::path outputFile = screenshotDir / screenshotName;
-
+void writePPM(fs::path outputFile) {
+  ProfileScope scope(profiler, STAGE_WRITE_PPM);
   FILE* f = fopen(string(outputFile).c_str(), "w");
   if (f == NULL) {
     std::cout << "Could not open file." << '\n';
     exit(1);
   }
-  fprintf(f, "P6\n%d %d\n255\n", WIDTH, HEIGHT); // P6
-
-  uint32_t colour;
-  uint8_t r,g,b;
-  for (int j=0; j<HEIGHT; j++) {
-    for (int i=0; i<WIDTH; i++) {
-      colour = window.getPixelColour(i, j);
-      r = (uint8_t)((colour >> 16) & 0xff);
-      g = (uint8_t)((colour >> 8) & 0xff);
-      b = (uint8_t)(colour & 0xff);
-      fputc(r, f);
-      fputc(g, f);
-      fputc(b, f);
+  fprintf(f, "P6\n%d %d\n255\n", framebuffer.width, framebuffer.height); // P6
+
+  // Convert a row at a time, rather than a pixel at a time, so big frames
+  // don't spend their time in fputc
+  vector<uint8_t> row(3 * framebuffer.width);
+  for (int j=0; j<framebuffer.height; j++) {
+    const uint32_t* pixels = &framebuffer.pixels[j * framebuffer.width];
+    for (int i=0; i<framebuffer.width; i++) {
+      row[3*i]     = (uint8_t)((pixels[i] >> 16) & 0xff);
+      row[3*i + 1] = (uint8_t)((pixels[i] >> 8) & 0xff);
+      row[3*i + 2] = (uint8_t)(pixels[i] & 0xff);
     }
+    fwrite(row.data(), 1, row.size(), f);
   }
   fclose(f);
 }
 
+void writePPM() {
+  std::string frame = std::string(5 - to_string(frame_no).length(), '0') + to_string(frame_no);
+  fs::path screenshotName = fs::path(frame + SCREENSHOT_SUFFIX);
+  writePPM(screenshotDir / screenshotName);
+}
+
+// Reads a P6 PPM as written by writePPM, for comparing frames against
+bool readPPM(fs::path inputFile, vector<uint32_t>& pixels, int& width, int& height) {
+  FILE* f = fopen(string(inputFile).c_str(), "rb");
+  if (f == NULL) return false;
+  int maxColour;
+  if (fscanf(f, "P6 %d %d %d", &width, &height, &maxColour) != 3 || maxColour != 255) {
+    fclose(f);
+    return false;
+  }
+  fgetc(f);
+
+  vector<uint8_t> bytes(3 * width * height);
+  bool complete = (fread(bytes.data(), 1, bytes.size(), f) == bytes.size());
+  fclose(f);
+  pixels.resize(width * height);
+  for (int i=0; i<width * height; i++) {
+    pixels[i] = (bytes[3*i] << 16) + (bytes[3*i + 1] << 8) + bytes[3*i + 2];
+  }
+  return complete;
+}
+
 // For some reason, all the ways to "append" or "copy" vectors in C++ yield an
 // iterator, not a vector, which is no good. So we have to roll our own,
 // inefficient verson.
@@ -140,16 +279,22 @@ vector<GObject> joinGObjectVectors(vector<GObject> gobjects1, vector<GObject> go
   return result;
 }
 
-vec3 averageVerticesOfFaces(vector<ModelTriangle> faces) {
-  vec3 accVerts = vec3(0.0f, 0.0f, 0.0f);
+// The average of the faces' corners, so a vertex counts once per face it's
+// in. -Ofast lets the compiler reorder a sum however it vectorises the
+// loop, and a float sum of thousands of corners comes out a few ulps
+// different in each order, which moves whatever's placed relative to the
+// centre. Summing in double keeps the result the same to float precision
+// whatever the order.
+vec3 averageVerticesOfFaces(const Mesh& mesh) {
+  dvec3 accVerts = dvec3(0.0, 0.0, 0.0);
   int numVerts = 0;
-  for (auto f=faces.begin(); f != faces.end(); f++) {
+  for (int f=0; f<mesh.faceCount(); f++) {
     for (auto i=0; i<3; i++) {
-      accVerts += (*f).vertices[i];
+      accVerts += dvec3(mesh.vertex(f, i));
       numVerts += 1;
     }
   }
-  return accVerts / (float)numVerts;
+  return vec3(accVerts / (double)numVerts);
 }
 
 GObject& getGObjectByName(string gobjectName) {
@@ -162,39 +307,70 @@ GObject& getGObjectByName(string gobjectName) {
 
 vec3 getCentreOf(string gobjectName) {
   for (auto g=gobjects.begin(); g != gobjects.end(); g++) {
-    if ((*g).name == gobjectName) return averageVerticesOfFaces((*g).faces);
+    if ((*g).name == gobjectName) return averageVerticesOfFaces((*g).mesh);
   }
   cout << "Couldn't find a gobject called '" << gobjectName << "'." << endl;
   return vec3(0.0f,0.0f,0.0f);
 }
 
-void translateGObject(vec3 translationVector, GObject &gobject) {
-  for (uint i = 0; i < gobject.faces.size(); i++) {
-    for (uint j = 0; j < 3; j++) {
-      gobject.faces.at(i).vertices[j].x += translationVector.x;
-      gobject.faces.at(i).vertices[j].y += translationVector.y;
-      gobject.faces.at(i).vertices[j].z += translationVector.z;
+bool hasGObject(string gobjectName) {
+  for (auto g=gobjects.begin(); g != gobjects.end(); g++) {
+    if ((*g).name == gobjectName) return true;
+  }
+  return false;
+}
+
+// The average of every face's corners in the scene, summed in double for
+// the same reason as averageVerticesOfFaces()
+vec3 getSceneCentre() {
+  dvec3 accVerts = dvec3(0.0, 0.0, 0.0);
+  int numVerts = 0;
+  for (auto g=gobjects.begin(); g != gobjects.end(); g++) {
+    for (int f=0; f<(*g).mesh.faceCount(); f++) {
+      for (auto i=0; i<3; i++) {
+        accVerts += dvec3((*g).mesh.vertex(f, i));
+        numVerts += 1;
+      }
     }
   }
+  return vec3(accVerts / (double)numVerts);
+}
+
+// The default animation orbits the logo; other scenes orbit their centre.
+vec3 getAnimationTarget() {
+  if (hasGObject("logo")) return getCentreOf("logo");
+  return getSceneCentre();
+}
+
+void translateGObject(vec3 translationVector, GObject &gobject) {
+  vector<vec3>& vertices = gobject.mesh.vertices;
+  for (uint i = 0; i < vertices.size(); i++) {
+    vertices[i].x += translationVector.x;
+    vertices[i].y += translationVector.y;
+    vertices[i].z += translationVector.z;
+  }
+  gobject.updateBounds();
+  sceneChanged = true;
 }
 
 void translateGObjectToOrigin(GObject &gobject) {
-  vec3 objCentre = averageVerticesOfFaces(gobject.faces);
+  vec3 objCentre = averageVerticesOfFaces(gobject.mesh);
   translateGObject(-objCentre, gobject);
 }
 
 void rotateGObjectAboutY(float deg, GObject &gobject) {
   mat3 transform = rotMatY(deg2rad(deg));
   //printMat3(transform);
-  for (uint i = 0; i < gobject.faces.size(); i++) {
-    for (uint j = 0; j < 3; j++) {
-      gobject.faces.at(i).vertices[j] = transform * gobject.faces.at(i).vertices[j];
-    }
+  vector<vec3>& vertices = gobject.mesh.vertices;
+  for (uint i = 0; i < vertices.size(); i++) {
+    vertices[i] = transform * vertices[i];
   }
+  gobject.updateBounds();
+  sceneChanged = true;
 }
 
 void rotateGObjectAboutYInPlace(float deg, GObject &gobject) {
-  vec3 objCentre = averageVerticesOfFaces(gobject.faces);
+  vec3 objCentre = averageVerticesOfFaces(gobject.mesh);
   translateGObject(-objCentre, gobject);
   rotateGObjectAboutY(deg, gobject);
   translateGObject(objCentre, gobject);
@@ -209,29 +385,83 @@ void readOBJs() {
   vector<GObject> logo;
   vector<GObject> teapot;
 
-  // This tuple/optional nonsense is just to avoid changing OBJ_IO/Structure too much.
-  // For each obj file we load, it may have a texture file. We should have a global
-  // variable for each texture that we know will actually exist and set it to the
-  // value of the optional here.
-  optional<Texture> maybeTexture;
-
-  tie(scene, maybeTexture) = obj_io.loadOBJ("jamdy.obj");
+  // Each obj file's texture (if any) is loaded into textures, and its
+  // triangles refer to it by handle
+  scene = obj_io.loadOBJ("jamdy.obj", textures, &pool);
   scene = obj_io.scale_additive(scene);
-  //scene = obj_io.scale_multiplicative(WIDTH, scene);
-  if (maybeTexture) textures.push_back(maybeTexture.value());
+  //scene = obj_io.scale_multiplicative(REFERENCE_WIDTH, scene);
 
-  tie(logo, maybeTexture) = obj_io.loadOBJ("logo.obj");
+  logo = obj_io.loadOBJ("logo.obj", textures, &pool);
   logo = obj_io.scale_additive(logo);
   logo = obj_io.scale_multiplicative(1000, logo);
-  if (maybeTexture) textures.push_back(maybeTexture.value());
 
-  tie(teapot, maybeTexture) = obj_io.loadOBJ("teapot200.obj");
+  teapot = obj_io.loadOBJ("teapot200.obj", textures, &pool);
   teapot = obj_io.scale_additive(teapot);
-  teapot = obj_io.scale_multiplicative(WIDTH, teapot);
-  if (maybeTexture) textures.push_back(maybeTexture.value());
+  teapot = obj_io.scale_multiplicative(REFERENCE_WIDTH, teapot);
 
   gobjects = joinGObjectVectors(scene, logo);
   gobjects = joinGObjectVectors(gobjects, teapot);
+}
+
+// Loads a single OBJ file (plus its materials/texture) as the whole scene,
+// scaled into the same range as the default one so the camera can see it.
+void readSceneOBJ(string filename) {
+  gobjects = obj_io.loadOBJ(filename, textures, &pool);
+  gobjects = obj_io.scale_additive(gobjects);
+  gobjects = obj_io.scale_multiplicative(1000, gobjects);
+}
+
+// Gobjects known to be closed meshes wound counter-clockwise, whose back
+// faces can be culled (see GObject::cullBackFaces); --cull adds more. The
+// teapot isn't one: a few of its inside faces show through its openings.
+vector<string> closedGObjects = {"logo", "short_box", "tall_box"};
+
+void markClosedGObjects() {
+  for (uint i = 0; i < gobjects.size(); i++) {
+    GObject& gobject = gobjects.at(i);
+    gobject.cullBackFaces = std::count(closedGObjects.begin(), closedGObjects.end(), gobject.name) > 0;
+  }
+}
+
+// Replaces the scene with the default one (sceneFile empty) or a single OBJ,
+// and puts the camera and light back where that scene starts them. The
+// loaded gobjects and their BVH come from the scene cache if it has them;
+// otherwise they're loaded from the OBJ files and saved there for next time.
+void loadScene(string sceneFile) {
+  gobjects.clear();
+  textures.clear();
+  camera = Camera();
+  light = Light();
+  frame_no = 0;
+  sceneChanged = true;
+
+  string cacheName = sceneFile.empty() ? "default scene" : sceneFile;
+  vector<BVHNode> cachedNodes;
+  vector<int> cachedOrder;
+  bool cached = useSceneCache && sceneCache.load(cacheName, gobjects, textures, cachedNodes, cachedOrder);
+  if (cached) {
+    markClosedGObjects();
+    // If the saved tree doesn't fit the saved gobjects the entry is no good:
+    // load the OBJ files again, so the entry saved over it lists them
+    cached = bvh.restore(gobjects, cachedNodes, cachedOrder);
+  }
+  if (cached) sceneChanged = false;
+  else {
+    gobjects.clear();
+    textures.clear();
+    obj_io.sourceFiles.clear();
+    if (sceneFile.empty()) readOBJs();
+    else readSceneOBJ(sceneFile);
+    // Loading scales the vertices after making the gobjects
+    for (uint i = 0; i < gobjects.size(); i++) gobjects.at(i).updateBounds();
+    if (hasGObject("logo")) translateGObject(vec3(0.0, 150.0, 700.0), getGObjectByName("logo"));
+    markClosedGObjects();
+    if (useSceneCache) {
+      bvh.build(gobjects);
+      sceneChanged = false;
+      sceneCache.save(cacheName, obj_io.sourceFiles, gobjects, textures, bvh);
+    }
+  }
 
   // Find the light gobject, average its vertices, and use that as the light pos
   // (but shift it down slightly first, so it doesn't lie exactly within the
@@ -239,8 +469,57 @@ void readOBJs() {
   // Otherwise the light keeps its default position.
   vector<GObject>::iterator maybeLight = find_if(gobjects.begin(), gobjects.end(), isLight);
   if (maybeLight != gobjects.end()) {
-    light.Position = averageVerticesOfFaces((*maybeLight).faces) - vec3(0.0f, 10.0f, 0.0f);
+    light.Position = averageVerticesOfFaces((*maybeLight).mesh) - vec3(0.0f, 10.0f, 0.0f);
   }
+
+  if (hasGObject("logo")) {
+    vec3 avgLogo = getCentreOf("logo");
+    camera.position[1] = avgLogo[1];
+    camera.position[2] = avgLogo[2];
+
+    light.Position = avgLogo;
+    light.Position.z = 500.0f;
+  }
+  if (!sceneFile.empty()) camera.lookAt(getSceneCentre());
+}
+
+// Splits every triangle into four at its edge midpoints, levels times over.
+// The surfaces (and so the rendered image) stay the same, but there are
+// 4^levels times as many triangles, which makes a scaled-up scene to
+// benchmark with.
+void subdivideGObjects(int levels) {
+  // Corners 0-2 are the original vertices, 3-5 the midpoints of edges 01,
+  // 12 and 20; the winding of each part matches the original
+  const int parts[4][3] = {{0, 3, 5}, {3, 1, 4}, {5, 4, 2}, {3, 4, 5}};
+  for (int level = 0; level < levels; level++) {
+    for (uint i = 0; i < gobjects.size(); i++) {
+      vector<ModelTriangle> split;
+      for (int j = 0; j < gobjects.at(i).mesh.faceCount(); j++) {
+        const ModelTriangle face = gobjects.at(i).mesh.face(j);
+        vec3 corners[6];
+        vec2 textureCorners[6];
+        for (int k = 0; k < 3; k++) {
+          corners[k] = face.vertices[k];
+          corners[k + 3] = (face.vertices[k] + face.vertices[(k + 1) % 3]) * 0.5f;
+          if (face.maybeTextureTriangle) {
+            const TextureTriangle& tt = face.maybeTextureTriangle.value();
+            textureCorners[k] = tt.vertices[k];
+            textureCorners[k + 3] = (tt.vertices[k] + tt.vertices[(k + 1) % 3]) * 0.5f;
+          }
+        }
+        for (int p = 0; p < 4; p++) {
+          ModelTriangle part = face;
+          for (int k = 0; k < 3; k++) {
+            part.vertices[k] = corners[parts[p][k]];
+            if (face.maybeTextureTriangle) part.maybeTextureTriangle.value().vertices[k] = textureCorners[parts[p][k]];
+          }
+          split.push_back(part);
+        }
+      }
+      gobjects.at(i).mesh = Mesh::fromTriangles(split);
+    }
+  }
+  sceneChanged = true;
 }
 
 // Raster Functions
@@ -270,14 +549,20 @@ std::vector<CanvasPoint> interpolate_line(CanvasPoint from, CanvasPoint to) {
   std::vector<CanvasPoint> v;
   for (float i = 0.0; i < no_steps; i++) {
     CanvasPoint interp_point(from.x + (i * stepSize_X), from.y + (i * stepSize_Y), from.depth + (i * stepSize_dep));
-    TexturePoint interp_tp(from.texturePoint.x + (i * stepSize_tp_X), from.texturePoint.y + (i * stepSize_tp_Y), to.texturePoint.textureName);
+    TexturePoint interp_tp(from.texturePoint.x + (i * stepSize_tp_X), from.texturePoint.y + (i * stepSize_tp_Y), to.texturePoint.texture);
     interp_point.texturePoint = interp_tp;
     v.push_back(interp_point);
   }
   return v;
 }
 
-void drawLine(CanvasPoint P1, CanvasPoint P2, Colour colour) {
+bool passesDepthTest(const CanvasPoint& pixel) {
+  ProfileScope scope(profiler, STAGE_DEPTH_TEST);
+  return depthbuf.update(pixel);
+}
+
+
+void drawLine(CanvasPoint P1, CanvasPoint P2, uint32_t colour) {
   if (buf_mode == TEXTURE) return;
   std::vector<CanvasPoint> interp_line = interpolate_line(P1, P2);
 
@@ -285,22 +570,33 @@ void drawLine(CanvasPoint P1, CanvasPoint P2, Colour colour) {
     CanvasPoint pixel = interp_line.at(i);
     float x = pixel.x;
     float y = pixel.y;
-    if (depthbuf.update(pixel)) window.setPixelColour(round(x), round(y), get_rgb(colour));
+    if (passesDepthTest(pixel)) {
+      if (buf_mode == VISIBILITY) visbuf.triangle[(int)(round(x) + (screenWidth * round(y)))] = rasterTriangle;
+      else framebuffer.setPixelColour(round(x), round(y), colour);
+    }
   }
 }
 
-uint32_t get_textured_pixel(TexturePoint texturePoint) {
-  //std::cout << "Texture name: " << texturePoint.textureName << '\n';
-  for (uint i = 0; i < textures.size(); i++) {
-    if (textures.at(i).textureFilename == texturePoint.textureName)
-      return textures.at(i).ppm_image[(int)(round(texturePoint.x) + (round(texturePoint.y) * textures.at(i).width))];
-  }
-  return ((255 << 16) + 255);
+// Colour of the texture at (x, y), in texels, for a pixel lod mip levels
+// down (see Texture::lodFor()), filtered as textureFilter says
+uint32_t getTexel(const Texture& texture, float x, float y, float lod) {
+  ProfileScope scope(profiler, STAGE_TEXTURE_LOOKUP);
+  return texture.sample(x, y, lod, textureFilter);
+}
+
+// What textured pixels show when their texture wasn't loaded
+#define MISSING_TEXTURE_COLOUR ((255 << 16) + 255)
+
+uint32_t get_textured_pixel(const TexturePoint& texturePoint) {
+  const Texture* texture = textures.get(texturePoint.texture);
+  // The scanline path doesn't know how big its pixels are on the texture
+  if (texture != nullptr) return getTexel(*texture, texturePoint.x, texturePoint.y, 0.0f);
+  return MISSING_TEXTURE_COLOUR;
   //return textures.at(0).ppm_image[(int)(round(texturePoint.x) + (round(texturePoint.y) * textures.at(0).width))];
 }
 
 void drawTexturedLine(CanvasPoint P1, CanvasPoint P2, CanvasTriangle triangle) {
-  if (triangle.colour.name == "material_0") {
+  if (materials.has(triangle.material, MaterialTable::STRETCH_TEXTURE)) {
     P1.texturePoint.x = 0.0f;
     P2.texturePoint.x = 64.0f;
   }
@@ -312,13 +608,14 @@ void drawTexturedLine(CanvasPoint P1, CanvasPoint P2, CanvasTriangle triangle) {
     float x = pixel.x;
     float y = pixel.y;
     uint32_t colour = get_textured_pixel(pixel.texturePoint);
-    if (round(x) >= 0 && round(x) < WIDTH && round(y) >= 0 && round(y) < HEIGHT) {
-      if (depthbuf.update(pixel)) {
+    if (round(x) >= 0 && round(x) < screenWidth && round(y) >= 0 && round(y) < screenHeight) {
+      if (passesDepthTest(pixel)) {
         if (buf_mode == WINDOW) {
-          window.setPixelColour(round(x), round(y), colour);
+          framebuffer.setPixelColour(round(x), round(y), colour);
         }
         else {
-          texture_buffer[(int)(round(x) + (WIDTH * round(y)))] = colour;
+          texture_buffer[(int)(round(x) + (screenWidth * round(y)))] = colour;
+          if (buf_mode == VISIBILITY) visbuf.triangle[(int)(round(x) + (screenWidth * round(y)))] = rasterTriangle;
         }
       }
     }
@@ -327,9 +624,11 @@ void drawTexturedLine(CanvasPoint P1, CanvasPoint P2, CanvasTriangle triangle) {
 }
 
 void drawStrokedTriangle(CanvasTriangle triangle) {
-  drawLine(triangle.vertices[0], triangle.vertices[1], triangle.colour);
-  drawLine(triangle.vertices[0], triangle.vertices[2], triangle.colour);
-  drawLine(triangle.vertices[1], triangle.vertices[2], triangle.colour);
+  ProfileScope scope(profiler, STAGE_TRIANGLE_FILL);
+  uint32_t colour = materials.rgb(triangle.material);
+  drawLine(triangle.vertices[0], triangle.vertices[1], colour);
+  drawLine(triangle.vertices[0], triangle.vertices[2], colour);
+  drawLine(triangle.vertices[1], triangle.vertices[2], colour);
 }
 
 void sortTrianglePoints(CanvasTriangle *triangle) {
@@ -343,20 +642,10 @@ void equateTriangles(CanvasTriangle from, CanvasTriangle *to) {
     to->vertices[i].depth = from.vertices[i].depth;
     to->vertices[i].texturePoint = from.vertices[i].texturePoint;
   }
-  to->colour = from.colour;
+  to->material = from.material;
   to->textured = from.textured;
 }
 
-bool compareTriangles(ModelTriangle A, ModelTriangle B) {
-  for (int i = 0; i < 3; i++) {
-    if (round(A.vertices[i][0]) != round(B.vertices[i][0])) return false;
-    if (round(A.vertices[i][1]) != round(B.vertices[i][1])) return false;
-    if (round(A.vertices[i][2]) != round(B.vertices[i][2])) return false;
-  }
-  // TODO compare colours too
-  return true;
-}
-
 void getTopBottomTriangles(CanvasTriangle triangle, CanvasTriangle *top, CanvasTriangle *bottom) {
   if ((round(triangle.vertices[0].y) == round(triangle.vertices[1].y)) || (round(triangle.vertices[1].y) == round(triangle.vertices[2].y))) {
     CanvasPoint temp = triangle.vertices[1];
@@ -375,9 +664,9 @@ void getTopBottomTriangles(CanvasTriangle triangle, CanvasTriangle *top, CanvasT
     }
   }
 
-  //CONSTRUCTOR: CanvasTriangle(CanvasPoint v0, CanvasPoint v1, CanvasPoint v2, Colour c)
-  CanvasTriangle top_Triangle(triangle.vertices[0], point4, triangle.vertices[1], triangle.colour, triangle.textured);
-  CanvasTriangle bot_Triangle(point4, triangle.vertices[2], triangle.vertices[1], triangle.colour, triangle.textured);
+  //CONSTRUCTOR: CanvasTriangle(CanvasPoint v0, CanvasPoint v1, CanvasPoint v2, MaterialId m, bool tex)
+  CanvasTriangle top_Triangle(triangle.vertices[0], point4, triangle.vertices[1], triangle.material, triangle.textured);
+  CanvasTriangle bot_Triangle(point4, triangle.vertices[2], triangle.vertices[1], triangle.material, triangle.textured);
 
   equateTriangles(top_Triangle, top);
   equateTriangles(bot_Triangle, bottom);
@@ -386,12 +675,15 @@ void getTopBottomTriangles(CanvasTriangle triangle, CanvasTriangle *top, CanvasT
 void fillFlatBaseTriangle(CanvasTriangle triangle, int side1_A, int side1_B, int side2_A, int side2_B) {
   std::vector<CanvasPoint> side1 = interpolate_line(triangle.vertices[side1_A], triangle.vertices[side1_B]);
   std::vector<CanvasPoint> side2 = interpolate_line(triangle.vertices[side2_A], triangle.vertices[side2_B]);
+  // Two coincident vertices give an empty side
+  if (side1.empty() || side2.empty()) return;
 
   uint last_drawn_y = round(side1.at(0).y);
-  // std::cout << "Point at (" << side1.at(0).x << ", " << side1.at(0).y << "), colour " << triangle.colour;
+  // std::cout << "Point at (" << side1.at(0).x << ", " << side1.at(0).y << "), colour " << materials.colour(triangle.material);
   // std::cout << "  has texturepoints " << side1.at(0).texturePoint << " textured = " << triangle.textured << endl;
+  uint32_t colour = materials.rgb(triangle.material);
   if (triangle.textured) drawTexturedLine(side1.at(0), side2.at(0), triangle);
-  else drawLine(side1.at(0), side2.at(0), triangle.colour);
+  else drawLine(side1.at(0), side2.at(0), colour);
 
   for (uint i = 0; i < side1.size(); i++) {
     if (round(side1.at(i).y) != last_drawn_y) {
@@ -401,43 +693,261 @@ void fillFlatBaseTriangle(CanvasTriangle triangle, int side1_A, int side1_B, int
       }
       if (triangle.textured) drawTexturedLine(side1.at(i), side2.at(j), triangle);
       else {
-        drawLine(side1.at(i), side2.at(j), triangle.colour);
+        drawLine(side1.at(i), side2.at(j), colour);
       }
       last_drawn_y++;
     }
   }
 }
 
-bool pointsOnLine(CanvasTriangle triangle, int a, int b, int c) {
-  std::vector<CanvasPoint> v = interpolate_line(triangle.vertices[a], triangle.vertices[b]);
-  for (uint i = 0; i < v.size(); i++) {
-    if ((round(v.at(i).x) == round(triangle.vertices[c].x)) && (round(v.at(i).y) == round(triangle.vertices[c].y))) {
-      return true;
-    }
-  }
-  return false;
-}
+// The original scanline fill, replaced by drawFilledTriangle() and only
+// kept as the baseline for benchmarkRasteriser.
+void drawFilledTriangleScanline(CanvasTriangle triangle) {
+  ProfileScope scope(profiler, STAGE_TRIANGLE_FILL);
+  sortTrianglePoints(&triangle);
+  CanvasTriangle triangles[2];
 
-bool triangleIsLine(CanvasTriangle triangle) {
-  if (pointsOnLine(triangle, 0, 1, 2)) return true;
-  if (pointsOnLine(triangle, 0, 2, 1)) return true;
-  if (pointsOnLine(triangle, 1, 2, 0)) return true;
-  return false;
+  getTopBottomTriangles(triangle, &triangles[0], &triangles[1]);
+  fillFlatBaseTriangle(triangles[0], 0, 1, 0, 2);
+  fillFlatBaseTriangle(triangles[1], 0, 1, 2, 1);
 }
 
-void drawFilledTriangle(CanvasTriangle triangle) {
-  sortTrianglePoints(&triangle);
-  CanvasTriangle triangles[2];
+// Sub-pixel precision of the rasteriser: vertices are snapped to 1/16 of a
+// pixel (28.4 fixed point)
+#define SUBPIXEL_BITS 4
+#define SUBPIXEL_STEPS (1 << SUBPIXEL_BITS)
+
+// The rectangle of the screen [x0, x1) x [y0, y1) a triangle is drawn into,
+// and the depth buffer it's tested against, which holds 1/depth for the
+// rectangle's pixels (from (x0, y0), a row every depthStride)
+struct RasterTarget {
+  int x0, y0, x1, y1;
+  float* depth;
+  int depthStride;
+};
+
+// Edge-function rasteriser. The vertices are snapped to 28.4 fixed point, so
+// the three edge functions are exact integers that step by a constant along
+// a row and down a column. Pixels are sampled at their centres (the whole
+// pixel coordinates). A sample is covered when it's on the inside of every
+// edge, and one that lies exactly on an edge only counts for the triangle
+// the edge is a top or left edge of, so triangles sharing an edge never
+// both draw (or both miss) a pixel along it. Zero-area triangles have no
+// inside and so draw nothing, with no special case. 1/depth is interpolated
+// linearly across the screen, which is exact now that depth is camera-space
+// z, and texture coordinates are interpolated in perspective (see
+// AttributeInterpolator). Only the part of the triangle inside target is drawn,
+// and visibleTriangle is what goes in the visibility buffer. Nothing here
+// allocates.
+void drawFilledTriangle(const CanvasTriangle& triangle, const RasterTarget& target, int visibleTriangle) {
+  // The ray pass only reads textured pixels back from the texture buffer
+  if (buf_mode == TEXTURE && !triangle.textured) return;
+
+  // Vertices that project to somewhere absurd (e.g. from behind the camera)
+  // would overflow the edge functions, so skip those triangles
+  const float limit = 1 << 24;
+  for (int k = 0; k < 3; k++) {
+    if (!(fabs(triangle.vertices[k].x) < limit && fabs(triangle.vertices[k].y) < limit)) return;
+  }
 
-  if (triangleIsLine(triangle)) {
-    drawLine(triangle.vertices[0], triangle.vertices[1], triangle.colour);
-    drawLine(triangle.vertices[1], triangle.vertices[2], triangle.colour);
+  int64_t x[3], y[3];
+  for (int k = 0; k < 3; k++) {
+    x[k] = llround(triangle.vertices[k].x * SUBPIXEL_STEPS);
+    y[k] = llround(triangle.vertices[k].y * SUBPIXEL_STEPS);
   }
-  else {
-    getTopBottomTriangles(triangle, &triangles[0], &triangles[1]);
-    fillFlatBaseTriangle(triangles[0], 0, 1, 0, 2);
-    fillFlatBaseTriangle(triangles[1], 0, 1, 2, 1);
+  int64_t area = ((x[1] - x[0]) * (y[2] - y[0])) - ((y[1] - y[0]) * (x[2] - x[0]));
+  if (area == 0) return;
+  ProfileScope scope(profiler, STAGE_TRIANGLE_FILL);
+  // Wind the triangle so that inside is where every edge function is positive
+  int v1 = 1, v2 = 2;
+  if (area < 0) {
+    std::swap(v1, v2);
+    area = -area;
+  }
+
+  // The pixels whose centres are inside the bounding box (rounding the low
+  // edge up and the high edge down; >> floors negative values too)
+  const int64_t roundUp = SUBPIXEL_STEPS - 1;
+  int minX = std::max<int64_t>(target.x0, (std::min({x[0], x[1], x[2]}) + roundUp) >> SUBPIXEL_BITS);
+  int maxX = std::min<int64_t>(target.x1 - 1, std::max({x[0], x[1], x[2]}) >> SUBPIXEL_BITS);
+  int minY = std::max<int64_t>(target.y0, (std::min({y[0], y[1], y[2]}) + roundUp) >> SUBPIXEL_BITS);
+  int maxY = std::min<int64_t>(target.y1 - 1, std::max({y[0], y[1], y[2]}) >> SUBPIXEL_BITS);
+  if (minX > maxX || minY > maxY) return;
+
+  // Edge k is opposite vertex k: w_k(x, y) = A*x + B*y + C, in 1/16ths of a
+  // pixel on both axes, so it steps by 16*A per pixel along a row. With y
+  // pointing down, a top edge is horizontal with the inside below it
+  // (A == 0, B > 0) and a left edge has the inside to its right (A > 0).
+  // Other edges are biased by -1 so that samples exactly on them fail the
+  // >= 0 test; every w is a whole number so nothing else moves.
+  int corner[3] = {0, v1, v2};
+  int64_t A[3], B[3], bias[3], rowStart[3];
+  for (int k = 0; k < 3; k++) {
+    int a = corner[(k + 1) % 3], b = corner[(k + 2) % 3];
+    A[k] = y[a] - y[b];
+    B[k] = x[b] - x[a];
+    bool topLeft = (A[k] > 0) || (A[k] == 0 && B[k] > 0);
+    bias[k] = topLeft ? 0 : -1;
+    rowStart[k] = (A[k] * (((int64_t)minX << SUBPIXEL_BITS) - x[a])) + (B[k] * (((int64_t)minY << SUBPIXEL_BITS) - y[a]));
+    A[k] *= SUBPIXEL_STEPS;
+    B[k] *= SUBPIXEL_STEPS;
+  }
+
+  double invArea = 1.0 / area;
+  const CanvasPoint& p0 = triangle.vertices[corner[0]];
+  const CanvasPoint& p1 = triangle.vertices[corner[1]];
+  const CanvasPoint& p2 = triangle.vertices[corner[2]];
+
+  // 1/depth is what the depth buffer compares, so interpolate that rather
+  // than depth and save a divide per pixel. It's a plane over the screen:
+  // its value at the first pixel of the row, and its step along the row.
+  double invDepth[3] = {1.0 / p0.depth, 1.0 / p1.depth, 1.0 / p2.depth};
+  double rowInvDepth = 0.0, invDepthStepX = 0.0, invDepthStepY = 0.0;
+  for (int k = 0; k < 3; k++) {
+    rowInvDepth += rowStart[k] * invDepth[k] * invArea;
+    invDepthStepX += A[k] * invDepth[k] * invArea;
+    invDepthStepY += B[k] * invDepth[k] * invArea;
+  }
+
+  // Blocks of pixels are rasterised with 32 bit edge functions, which is
+  // fine unless the triangle reaches far off screen; the rest go a pixel at
+  // a time. The sums are bounds on |w| anywhere a block reaches.
+  bool useBlocks = true;
+  for (int k = 0; k < 3; k++) {
+    int64_t bound = std::abs(rowStart[k]) + (std::abs(A[k]) * (maxX - minX + BlockRaster::WIDTH)) + (std::abs(B[k]) * (maxY - minY + 1));
+    if (bound >= INT32_MAX) useBlocks = false;
+  }
+
+  const Texture* texture = triangle.textured ? textures.get(p0.texturePoint.texture) : nullptr;
+  uint32_t flatColour = materials.rgb(triangle.material);
+  uint32_t* colourBuffer = (buf_mode == WINDOW) ? framebuffer.pixels.data() : texture_buffer.data();
+
+  // The teapot's material was drawn by stretching its texture from 0 to 64
+  // texels across each scanline, starting from the triangle's long edge, so
+  // keep doing that. Order the vertices top to bottom to find the edges.
+  bool stretchRows = triangle.textured && materials.has(triangle.material, MaterialTable::STRETCH_TEXTURE);
+  const CanvasPoint* sorted[3] = {&triangle.vertices[0], &triangle.vertices[1], &triangle.vertices[2]};
+  if (stretchRows) {
+    std::sort(sorted, sorted + 3, [](const CanvasPoint* a, const CanvasPoint* b) { return a->y < b->y; });
   }
+  float longX = 0.0f, texelsPerPixel = 0.0f;
+
+  // The texture coordinates, in perspective
+  AttributeInterpolator<2> uv;
+  if (texture != nullptr) {
+    double weight[3], weightX[3], weightY[3];
+    for (int k = 0; k < 3; k++) {
+      weight[k] = rowStart[k] * invArea;
+      weightX[k] = A[k] * invArea;
+      weightY[k] = B[k] * invArea;
+    }
+    float invZ[3] = {(float)invDepth[0], (float)invDepth[1], (float)invDepth[2]};
+    float corners[3][2] = {{p0.texturePoint.x, p0.texturePoint.y}, {p1.texturePoint.x, p1.texturePoint.y},
+                           {p2.texturePoint.x, p2.texturePoint.y}};
+    uv.setup(weight, weightX, weightY, invZ, corners);
+  }
+
+  // The colour of a textured pixel. Filtering from the mip chain needs to
+  // know how far the texture coordinates move per pixel, there.
+  auto texturedColour = [&](int px, int py) {
+    if (texture == nullptr) return (uint32_t)MISSING_TEXTURE_COLOUR;
+    float t[2];
+    float z = uv.at(px - minX, py - minY, t);
+    if (stretchRows) t[0] = (px - longX) * texelsPerPixel;
+    float lod = 0.0f;
+    if (textureFilter != FILTER_NEAREST) {
+      float dudx = stretchRows ? texelsPerPixel : uv.derivativeX(0, t[0], z);
+      float dudy = stretchRows ? 0.0f : uv.derivativeY(0, t[0], z);
+      lod = Texture::lodFor(dudx, uv.derivativeX(1, t[1], z), dudy, uv.derivativeY(1, t[1], z));
+    }
+    return getTexel(*texture, t[0], t[1], lod);
+  };
+
+  for (int py = minY; py <= maxY; py++) {
+    if (stretchRows) {
+      const CanvasPoint& top = *sorted[0];
+      const CanvasPoint& mid = *sorted[1];
+      const CanvasPoint& bottom = *sorted[2];
+      auto xAt = [py](const CanvasPoint& a, const CanvasPoint& b) {
+        return (b.y == a.y) ? a.x : a.x + ((b.x - a.x) * ((py - a.y) / (b.y - a.y)));
+      };
+      longX = xAt(top, bottom);
+      float shortX = (py < mid.y) ? xAt(top, mid) : xAt(mid, bottom);
+      texelsPerPixel = (shortX == longX) ? 0.0f : 64.0f / (shortX - longX);
+    }
+    int rowOffset = screenWidth * py;
+    float* depthRow = target.depth + ((py - target.y0) * target.depthStride) - target.x0;
+
+    if (useBlocks) {
+      PixelBlock block;
+      for (int k = 0; k < 3; k++) block.step[k] = A[k];
+      block.invDepthStep = (float)invDepthStepX;
+      for (int px = minX; px <= maxX; px += BlockRaster::WIDTH) {
+        int offset = px - minX;
+        for (int k = 0; k < 3; k++) block.w[k] = rowStart[k] + bias[k] + (A[k] * offset);
+        block.invDepth = (float)(rowInvDepth + (invDepthStepX * offset));
+        int p = px + rowOffset;
+        unsigned mask;
+        {
+          ProfileScope scope(profiler, STAGE_DEPTH_TEST);
+          mask = blockRaster.depthTest(block, std::min(BlockRaster::WIDTH, maxX - px + 1), depthRow + px);
+        }
+        if (mask == 0) continue;
+        if (triangle.textured) {
+          for (unsigned bits = mask; bits != 0; bits &= bits - 1) {
+            int i = __builtin_ctz(bits);
+            colourBuffer[p + i] = texturedColour(px + i, py);
+          }
+        }
+        else if (buf_mode == WINDOW) blockRaster.store(colourBuffer + p, flatColour, mask);
+        if (buf_mode == VISIBILITY) blockRaster.store((uint32_t*)visbuf.triangle.data() + p, visibleTriangle, mask);
+      }
+    }
+    else {
+      int64_t w0 = rowStart[0], w1 = rowStart[1], w2 = rowStart[2];
+      for (int px = minX; px <= maxX; px++) {
+        if (((w0 + bias[0]) | (w1 + bias[1]) | (w2 + bias[2])) >= 0) {
+          ProfileScope depthScope(profiler, STAGE_DEPTH_TEST);
+          float invDepth = (float)(rowInvDepth + (invDepthStepX * (px - minX)));
+          if (invDepth > depthRow[px]) {
+            depthRow[px] = invDepth;
+            int p = px + rowOffset;
+            if (triangle.textured) colourBuffer[p] = texturedColour(px, py);
+            else if (buf_mode == WINDOW) colourBuffer[p] = flatColour;
+            if (buf_mode == VISIBILITY) visbuf.triangle[p] = visibleTriangle;
+          }
+        }
+        w0 += A[0];
+        w1 += A[1];
+        w2 += A[2];
+      }
+    }
+    for (int k = 0; k < 3; k++) rowStart[k] += B[k];
+    rowInvDepth += invDepthStepY;
+  }
+}
+
+// Draws the whole of a triangle, testing against the frame's depth buffer
+void drawFilledTriangle(const CanvasTriangle& triangle, int visibleTriangle = -1) {
+  RasterTarget screen = {0, 0, screenWidth, screenHeight, depthbuf.depthbuf.data(), screenWidth};
+  // The depth buffer only needs to know roughly where; a pixel either side
+  // of the box is plenty
+  float lo[2] = {INFINITY, INFINITY}, hi[2] = {-INFINITY, -INFINITY};
+  for (int k = 0; k < 3; k++) {
+    lo[0] = std::min(lo[0], triangle.vertices[k].x);
+    lo[1] = std::min(lo[1], triangle.vertices[k].y);
+    hi[0] = std::max(hi[0], triangle.vertices[k].x);
+    hi[1] = std::max(hi[1], triangle.vertices[k].y);
+  }
+  depthbuf.markDirty(std::clamp(lo[0] - 1.0f, 0.0f, (float)screenWidth), std::clamp(lo[1] - 1.0f, 0.0f, (float)screenHeight),
+                     std::clamp(hi[0] + 2.0f, 0.0f, (float)screenWidth), std::clamp(hi[1] + 2.0f, 0.0f, (float)screenHeight));
+  drawFilledTriangle(triangle, screen, visibleTriangle);
+}
+
+// Scale the focal length (which is in pixels) with the image width, so that
+// every resolution frames the same view as the reference one
+float getScaledFocalLength() {
+  return camera.focalLength * ((float)screenWidth / REFERENCE_WIDTH);
 }
 
 glm::vec3 getAdjustedVector(glm::vec3 v) {
@@ -445,59 +955,134 @@ glm::vec3 getAdjustedVector(glm::vec3 v) {
   return cam2vertex * camera.orientation;
 }
 
-CanvasPoint projectVertexInto2D(glm::vec3 v) {
-  // Vector from camera to verted adjusted w.r.t. to the camera's orientation.
-  glm::vec3 adjVec = getAdjustedVector(v);
-
+// Projects a point already in camera space (see getAdjustedVector()), which
+// must be in front of the camera. Its depth is its camera-space z rather
+// than its distance from the camera: 1/z changes linearly across the screen,
+// so the rasteriser can interpolate it (and attributes over z) exactly.
+CanvasPoint projectAdjustedVector(glm::vec3 adjVec) {
   double w_i;                      //  width of canvaspoint from camera axis
   double h_i;                      // height of canvaspoint from camera axis
-  double d_i = camera.focalLength; // distance from camera to axis extension of canvas
+  double d_i = getScaledFocalLength(); // distance from camera to axis extension of canvas
 
-  double depth = sqrt((adjVec.z * adjVec.z) + (adjVec.x * adjVec.x) + (adjVec.y * adjVec.y));
+  double depth = adjVec.z;
 
-  w_i = ((adjVec.x * d_i) / adjVec.z) + (WIDTH / 2);
-  h_i = ((adjVec.y * d_i) / adjVec.z) + (HEIGHT / 2);
+  w_i = ((adjVec.x * d_i) / adjVec.z) + (screenWidth / 2);
+  h_i = ((adjVec.y * d_i) / adjVec.z) + (screenHeight / 2);
 
   CanvasPoint res((float)w_i, (float)h_i, depth);
   return res;
 }
 
-CanvasTriangle projectTriangleOntoImagePlane(ModelTriangle triangle) {
-  CanvasTriangle result;
+CanvasPoint projectVertexInto2D(glm::vec3 v) {
+  // Vector from camera to verted adjusted w.r.t. to the camera's orientation.
+  return projectAdjustedVector(getAdjustedVector(v));
+}
 
-  Texture t;
-  if (triangle.maybeTextureTriangle) {
-    for (uint j = 0; j < textures.size(); j++) {
-      if (triangle.maybeTextureTriangle.value().textureFilename == textures.at(j).textureFilename)
-        t = textures.at(j);
-    }
+// True if the camera-space points all lie outside the same plane of the view
+// frustum: behind the near plane, or off one side of the screen. The side
+// planes go through the camera, so they work for points behind it too.
+bool outsideFrustum(const glm::vec3* points, int count) {
+  float f = getScaledFocalLength();
+  float halfWidth = screenWidth / 2.0f, halfHeight = screenHeight / 2.0f;
+  // Inside is dot(plane, p) >= 0, e.g. x*f/z + halfWidth >= 0 for the left
+  const glm::vec3 planes[4] = {
+    glm::vec3(f, 0.0f, halfWidth), glm::vec3(-f, 0.0f, halfWidth),
+    glm::vec3(0.0f, f, halfHeight), glm::vec3(0.0f, -f, halfHeight)
+  };
+  bool allBehind = true;
+  for (int i = 0; i < count; i++) allBehind = allBehind && (points[i].z < NEAR_PLANE);
+  if (allBehind) return true;
+  for (int k = 0; k < 4; k++) {
+    bool allOutside = true;
+    for (int i = 0; i < count; i++) allOutside = allOutside && (glm::dot(planes[k], points[i]) < 0.0f);
+    if (allOutside) return true;
+  }
+  return false;
+}
+
+// True if the camera sees the triangle's back (clockwise) side, or sees it
+// edge on
+bool isBackFacing(const Mesh& mesh, int face) {
+  glm::vec3 v0 = mesh.vertex(face, 0);
+  glm::vec3 normal = glm::cross(mesh.vertex(face, 1) - v0, mesh.vertex(face, 2) - v0);
+  return glm::dot(normal, camera.position - v0) <= 0.0f;
+}
+
+// Whether any of the gobject could be on screen, going by its bounding box
+bool gobjectInView(const GObject& gobject) {
+  glm::vec3 corners[8];
+  for (int c = 0; c < 8; c++) {
+    glm::vec3 corner((c & 1) ? gobject.boundsHi.x : gobject.boundsLo.x,
+                     (c & 2) ? gobject.boundsHi.y : gobject.boundsLo.y,
+                     (c & 4) ? gobject.boundsHi.z : gobject.boundsLo.z);
+    corners[c] = getAdjustedVector(corner);
+  }
+  return !outsideFrustum(corners, 8);
+}
+
+// Projects a triangle into result, which must have room for two, and
+// returns how many it made: none if the triangle is entirely outside the
+// view frustum, and two if clipping off the part behind the near plane
+// leaves a quad. Clipping is done in camera space, before the divide by z,
+// with the texture coordinates interpolated along the clipped edges.
+int projectTriangleOntoImagePlane(const Mesh& mesh, int face, CanvasTriangle* result) {
+  glm::vec3 adjusted[3];
+  for (int i = 0; i < 3; i++) adjusted[i] = getAdjustedVector(mesh.vertex(face, i));
+  if (outsideFrustum(adjusted, 3)) return 0;
+
+  bool textured = mesh.textured(face);
+  int texture = mesh.faceTextures[face];
+  glm::vec2 texturePoints[3];
+  if (textured) {
+    const Texture* t = textures.get(texture);
+    glm::vec2 size = (t != nullptr) ? glm::vec2(t->width, t->height) : glm::vec2(0.0f);
+    for (int i = 0; i < 3; i++) texturePoints[i] = mesh.textureVertex(face, i) * size;
   }
 
+  // Walk the edges keeping the vertices in front of the near plane and
+  // adding one where an edge crosses it; the winding is unchanged
+  glm::vec3 points[4];
+  glm::vec2 pointTextures[4];
+  int n = 0;
   for (int i = 0; i < 3; i++) {
-    result.vertices[i] = projectVertexInto2D(triangle.vertices[i]);
-    if (triangle.maybeTextureTriangle) {
+    int next = (i + 1) % 3;
+    bool inFront = adjusted[i].z >= NEAR_PLANE;
+    if (inFront) {
+      points[n] = adjusted[i];
+      pointTextures[n++] = texturePoints[i];
+    }
+    if (inFront != (adjusted[next].z >= NEAR_PLANE)) {
+      float s = (NEAR_PLANE - adjusted[i].z) / (adjusted[next].z - adjusted[i].z);
+      points[n] = glm::mix(adjusted[i], adjusted[next], s);
+      points[n].z = NEAR_PLANE;
+      pointTextures[n++] = glm::mix(texturePoints[i], texturePoints[next], s);
+    }
+  }
 
-      result.vertices[i].texturePoint.x = triangle.maybeTextureTriangle.value().vertices[i][0];
-      result.vertices[i].texturePoint.y = triangle.maybeTextureTriangle.value().vertices[i][1];
-      result.vertices[i].texturePoint.x *= t.width;
-      result.vertices[i].texturePoint.y *= t.height;
-      result.vertices[i].texturePoint.textureName = triangle.maybeTextureTriangle.value().textureFilename;
+  CanvasPoint projected[4];
+  for (int i = 0; i < n; i++) {
+    projected[i] = projectAdjustedVector(points[i]);
+    if (textured) {
+      projected[i].texturePoint.x = pointTextures[i].x;
+      projected[i].texturePoint.y = pointTextures[i].y;
+      projected[i].texturePoint.texture = texture;
     }
     else {
-      result.vertices[i].texturePoint = TexturePoint(-1, -1, "UNASSIGNED");
+      projected[i].texturePoint = TexturePoint(-1, -1);
     }
   }
-  result.colour = triangle.colour;
-  result.textured = false;
-  if (triangle.maybeTextureTriangle) {
-    result.textured = true;
+  for (int k = 0; k + 2 < n; k++) {
+    result[k] = CanvasTriangle(projected[0], projected[k + 1], projected[k + 2], mesh.material(face), textured);
   }
-  return result;
+  return n - 2;
 }
 
 // Raytracing Functions
 // ---
-RayTriangleIntersection getPossibleIntersection(ModelTriangle triangle, glm::vec3 rayDir, glm::vec3 point) {
+// The original matrix-inverse ray/triangle test. The raytracer now uses the
+// TriangleStore's Moller-Trumbore test; this is only kept as the baseline for
+// benchmarkIntersection.
+RayTriangleIntersection getPossibleIntersection(const ModelTriangle& triangle, glm::vec3 rayDir, glm::vec3 point) {
   glm::vec3 e0 = triangle.vertices[1] - triangle.vertices[0];
   glm::vec3 e1 = triangle.vertices[2] - triangle.vertices[0];
   glm::vec3 SPVector = point - triangle.vertices[0];
@@ -519,190 +1104,398 @@ RayTriangleIntersection getPossibleIntersection(ModelTriangle triangle, glm::vec
   return RayTriangleIntersection();
 }
 
-RayTriangleIntersection getClosestIntersection(glm::vec3 rayDir) {
-  RayTriangleIntersection closestIntersectionFound = RayTriangleIntersection();
-
-  for (uint j=0; j<gobjects.size(); j++) {
-    for (uint i=0; i<gobjects.at(j).faces.size(); i++) {
-      ModelTriangle triangle = gobjects.at(j).faces.at(i);
-      RayTriangleIntersection possibleSolution = getPossibleIntersection(triangle, rayDir, camera.position);
-
-      if (possibleSolution.isSolution) {
-        if (possibleSolution.distanceFromPoint < closestIntersectionFound.distanceFromPoint) {
-          closestIntersectionFound = possibleSolution;
-        }
-      }
-    }
-  }
-  //if (!closestIntersectionFound.isSolution) std::cout << "Fired ray did not collide with geometry." << '\n';
-  return closestIntersectionFound;
+RayHit getClosestIntersection(glm::vec3 rayDir) {
+  ProfileScope scope(profiler, STAGE_PRIMARY_RAYS);
+  RayHit closest;
+  bvh.traverse(camera.position, rayDir, numeric_limits<float>::infinity(),
+    [&](int first, int count, float& tMax) {
+      bvh.triangles.closestInRange(first, count, camera.position, rayDir, tMax, closest);
+      return false;
+    });
+  //if (!closest.found()) std::cout << "Fired ray did not collide with geometry." << '\n';
+  return closest;
 }
 
-float getAngleOfIncidence(glm::vec3 point, ModelTriangle triangle) {
-  glm::vec3 norm_1 = glm::normalize(glm::cross((triangle.vertices[2] - triangle.vertices[0]), (triangle.vertices[1] - triangle.vertices[0])));
-  glm::vec3 norm_2 = glm::normalize(glm::cross((triangle.vertices[1] - triangle.vertices[0]), (triangle.vertices[2] - triangle.vertices[0])));
-
+float getAngleOfIncidence(glm::vec3 point, glm::vec3 normal) {
   glm::vec3 point_to_light = -light.Position + point;
   point_to_light = glm::normalize(point_to_light);
 
-  float AOI = glm::dot(norm_1, point_to_light);
+  // The triangles are double sided, so use whichever way the normal faces
+  // the light
+  float AOI = glm::dot(normal, point_to_light);
   if ((AOI < 0.0f) || (AOI >= 1.0f)) {
-    AOI = glm::dot(norm_2, point_to_light);
+    AOI = glm::dot(-normal, point_to_light);
   }
   return AOI;
 }
 
-bool isPointInShadow(glm::vec3 point, ModelTriangle self) {
+bool isPointInShadow(glm::vec3 point, int self) {
+  ProfileScope scope(profiler, STAGE_SHADOW_RAYS);
   glm::vec3 rayDir = -light.Position + point;
-  for (uint j=0; j<gobjects.size(); j++) {
-    for (uint i=0; i<gobjects.at(j).faces.size(); i++) {
-      ModelTriangle triangle = gobjects.at(j).faces.at(i);
-      if (!compareTriangles(self, triangle)) {
-        RayTriangleIntersection intersection = getPossibleIntersection(triangle, rayDir, light.Position);
-        if (intersection.isSolution) {
-          if (intersection.distanceFromPoint < glm::length(rayDir)) {
-            return true;
-          }
-        }
-      }
-
-    }
-  }
-  return false;
+  // Only occluders strictly between the light and the point matter, i.e.
+  // t < 1 in units of rayDir. The point's own triangle is skipped by index,
+  // and stopping SHADOW_EPSILON short of it keeps neighbours that share an
+  // edge with the point from shadowing it.
+  float tMax = 1.0f - (SHADOW_EPSILON / glm::length(rayDir));
+  return bvh.occluded(light.Position, rayDir, tMax, self);
 }
 
-Colour getTextureColourFromRasterizer(int i, int j) {
-  uint32_t intCol = texture_buffer[i + (WIDTH * j)];
-  uint8_t red = (intCol >> 16) & 0xff;
-  uint8_t green = (intCol >> 8) & 0xff;
-  uint8_t blue = (intCol) & 0xff;
+// A packed 0x00RRGGBB colour's red, green and blue
+ivec3 unpackRGB(uint32_t rgb) { return ivec3((rgb >> 16) & 0xff, (rgb >> 8) & 0xff, rgb & 0xff); }
 
-  Colour res(red, green, blue);
-  // cout << res << endl;
-  return res;
+ivec3 getTextureColourFromRasterizer(int i, int j) {
+  return unpackRGB(texture_buffer[i + (screenWidth * j)]);
 }
 
-Colour getAdjustedColour(RayTriangleIntersection intersection, int i, int j) {
-  Colour inputColour = intersection.intersectedTriangle.colour;
-  if (intersection.intersectedTriangle.maybeTextureTriangle)
+// The red, green and blue a ray sees where it hits. Nothing here allocates.
+ivec3 getAdjustedColour(const RayHit& hit, int i, int j) {
+  const FaceRef& triangle = bvh.triangles.source[hit.triangle];
+  ivec3 inputColour;
+  if (triangle.mesh->textured(triangle.face))
     inputColour = getTextureColourFromRasterizer(i, j);
+  else inputColour = unpackRGB(materials.rgb(triangle.mesh->material(triangle.face)));
 
-  float AOI = getAngleOfIncidence(intersection.intersectionPoint, intersection.intersectedTriangle);
-  float intensity = light.getIntensityAtPoint(intersection.intersectionPoint);
-  bool pointInShadow = isPointInShadow(intersection.intersectionPoint, intersection.intersectedTriangle);
+  glm::vec3 point = bvh.triangles.pointAt(hit.triangle, hit.u, hit.v);
+  float AOI = getAngleOfIncidence(point, bvh.triangles.normal(hit.triangle));
+  float intensity = light.getIntensityAtPoint(point);
+  bool pointInShadow = isPointInShadow(point, hit.triangle);
 
-  Colour res;
-  Colour ambient(inputColour.name + " AMBIENT", inputColour.red/5, inputColour.green/5, inputColour.blue/5);
+  ivec3 res;
+  ivec3 ambient = inputColour / 5;
   if (pointInShadow) return ambient;
   float adjAOI = AOI + 0.3;
   if (adjAOI > 1) adjAOI = 1;
   float rgbFactor = intensity * adjAOI;
   if (rgbFactor > 1) rgbFactor = 1;
 
-  res.red = round(min(255.0f, max(ambient.red, inputColour.red * rgbFactor)));
-  res.green = round(min(255.0f, max(ambient.green, inputColour.green * rgbFactor)));
-  res.blue = round(min(255.0f, max(ambient.blue, inputColour.blue * rgbFactor)));
-  res.name = inputColour.name + " LIGHT ADJUSTED";
+  res.r = round(min(255.0f, max(ambient.r, inputColour.r * rgbFactor)));
+  res.g = round(min(255.0f, max(ambient.g, inputColour.g * rgbFactor)));
+  res.b = round(min(255.0f, max(ambient.b, inputColour.b * rgbFactor)));
 
   return res;
 }
 
 // High Level Functions
 // ---
-void drawGeometryViaRayTracing() {
-  mat3 adjOrientation(camera.orientation[0], -camera.orientation[1], camera.orientation[2]);
+glm::vec3 getSubPixelRay(int i, int j, int sampleIndex, const mat3& adjOrientation) {
+  // Note: the sign of the y value here is flipped
+  //    in pixelRay and adjOrientation
+  //    to ensure continuity between raytracer and rasteriser
+
+  int x =  i - screenWidth / 2;
+  int y = -j + screenHeight / 2;
+
+  //Sets up the x and y sub-pixel offsets using modulo and boundary conditions
+  float x_Offset = 0.25f;
+  float y_Offset = 0.25f;
+  if (modulo(sampleIndex, (number_of_AA_samples / 2)) == 0) x_Offset *= -1;
+  if (sampleIndex >= (number_of_AA_samples / 2)) y_Offset *= -1;
+  if (sampleIndex >= 4) {
+    y_Offset *= 0.5f;
+    x_Offset *= 0.5f;
+  }
 
-  for (int j = 0; j < HEIGHT; j++) {
-    for (int i = 0; i < WIDTH; i++) {
-      // Note: the sign of the y value here is flipped
-      //    in pixelRay and adjOrientation
-      //    to ensure continuity between raytracer and rasteriser
-
-      int x =  i - WIDTH / 2;
-      int y = -j + HEIGHT / 2;
-
-      glm::vec3 subPixelRays[number_of_AA_samples];
-      for (int sampleIndex = 0; sampleIndex < number_of_AA_samples; sampleIndex++) {
-        //Sets up the x and y sub-pixel offsets using modulo and boundary conditions
-        float x_Offset = 0.25f;
-        float y_Offset = 0.25f;
-        if (modulo(sampleIndex, (number_of_AA_samples / 2)) == 0) x_Offset *= -1;
-        if (sampleIndex >= (number_of_AA_samples / 2)) y_Offset *= -1;
-        if (sampleIndex >= 4) {
-          y_Offset *= 0.5f;
-          x_Offset *= 0.5f;
-        }
+  return glm::vec3(x - x_Offset, y - y_Offset, getScaledFocalLength()) * adjOrientation;
+}
 
-        glm::vec3 pr = glm::vec3(x - x_Offset, y - y_Offset, camera.focalLength);
-        subPixelRays[sampleIndex] = pr;
-      }
+uint32_t rayTracePixel(int i, int j, const mat3& adjOrientation) {
+  int AA_red = 0, AA_green = 0, AA_blue = 0;
 
-      int AA_red = 0, AA_green = 0, AA_blue = 0;
+  for (int sampleIndex = 0; sampleIndex < number_of_AA_samples; sampleIndex++) {
+    RayHit subPixelHit = getClosestIntersection(getSubPixelRay(i, j, sampleIndex, adjOrientation));
 
-      for (int sampleIndex = 0; sampleIndex < number_of_AA_samples; sampleIndex++) {
-        subPixelRays[sampleIndex] = subPixelRays[sampleIndex] * adjOrientation;
-        RayTriangleIntersection subPixel_RTI = getClosestIntersection(subPixelRays[sampleIndex]);
+    if (subPixelHit.found()) {
+      ivec3 adjustedColour = getAdjustedColour(subPixelHit, i, j);
+      AA_red += adjustedColour.r;
+      AA_green += adjustedColour.g;
+      AA_blue += adjustedColour.b;
+    }
+  }
 
-        if (subPixel_RTI.isSolution) {
-          Colour adjustedColour = getAdjustedColour(subPixel_RTI, i, j);
-          AA_red += adjustedColour.red;
-          AA_green += adjustedColour.green;
-          AA_blue += adjustedColour.blue;
-        }
-      }
+  uint8_t avg_red = AA_red / number_of_AA_samples;
+  uint8_t avg_green = AA_green / number_of_AA_samples;
+  uint8_t avg_blue = AA_blue / number_of_AA_samples;
+  return (avg_red << 16) + (avg_green << 8) + (avg_blue);
+
+  // Legacy code for simple no AA raytracer; remove?
+  /*
+  int x =  i - screenWidth / 2;
+  int y = -j + screenHeight / 2;
+  glm::vec3 pixelRay(x, y, camera.focalLength);
+  pixelRay = pixelRay * adjOrientation;
+
+  RayTriangleIntersection RTI = getClosestIntersection(pixelRay);
+  if (RTI.isSolution) {
+    //std::cout << "Found solution with i: " << i << ", j: " << j << '\n';
+    Colour adjustedColour = getAdjustedColour(RTI, i, j);
+    framebuffer.setPixelColour(i, j, get_rgb(adjustedColour));
+  }
+  else framebuffer.setPixelColour(i, j, get_rgb(BLACK));
+  */
+}
 
-      uint8_t avg_red = AA_red / number_of_AA_samples;
-      uint8_t avg_green = AA_green / number_of_AA_samples;
-      uint8_t avg_blue = AA_blue / number_of_AA_samples;
-      uint32_t avg_colour = (avg_red << 16) + (avg_green << 8) + (avg_blue);
-      window.setPixelColour(i, j, avg_colour);
+// Shades a pixel of the hybrid mode from the visibility buffer: the
+// rasteriser has already said which triangle is there, so rather than
+// traversing the BVH the pixel's ray is only tested against that one
+// triangle, to get the barycentrics to shade at. Where the ray misses it
+// (the rasteriser and raytracer disagree slightly about triangle edges) a
+// full primary ray is cast instead. Always one sample per pixel.
+uint32_t shadeVisiblePixel(int i, int j, const mat3& adjOrientation) {
+  int p = i + (screenWidth * j);
+  if (visbuf.triangle[p] < 0) return 0;
+
+  glm::vec3 rayDir = getSubPixelRay(i, j, 0, adjOrientation);
+  RayHit hit;
+  hit.triangle = visbuf.triangle[p];
+  bool resolved;
+  {
+    ProfileScope scope(profiler, STAGE_PRIMARY_RAYS);
+    resolved = bvh.triangles.intersect(hit.triangle, camera.position, rayDir, numeric_limits<float>::infinity(), hit.t, hit.u, hit.v);
+  }
+  if (!resolved) {
+    visbuf.fallbacks.fetch_add(1, memory_order_relaxed);
+    hit = getClosestIntersection(rayDir);
+    if (!hit.found()) return 0;
+  }
+  visbuf.u[p] = hit.u;
+  visbuf.v[p] = hit.v;
 
-      // Legacy code for simple no AA raytracer; remove?
-      /*
-      int x =  i - WIDTH / 2;
-      int y = -j + HEIGHT / 2;
-      glm::vec3 pixelRay(x, y, camera.focalLength);
-      pixelRay = pixelRay * adjOrientation;
+  ivec3 colour = getAdjustedColour(hit, i, j);
+  return (colour.r << 16) + (colour.g << 8) + colour.b;
+}
 
-      RayTriangleIntersection RTI = getClosestIntersection(pixelRay);
-      if (RTI.isSolution) {
-        //std::cout << "Found solution with i: " << i << ", j: " << j << '\n';
-        Colour adjustedColour = getAdjustedColour(RTI, i, j);
-        window.setPixelColour(i, j, get_rgb(adjustedColour));
-      }
-      else window.setPixelColour(i, j, get_rgb(BLACK));
-      */
+// Every pixel only depends on the scene, so tiles can be traced in any order
+// on any thread and the frame still comes out identical to a serial render.
+// Whole tiles are traced into a scratch block whose stride is fixed at
+// compile time and then copied into the frame a row at a time; tiles clipped
+// by the right or bottom edge of the image go pixel by pixel instead.
+// shadePixel(i, j) gives each pixel's colour.
+template <int BLOCK_W, int BLOCK_H, typename PixelShader>
+void rayTraceBlock(int x0, int y0, PixelShader& shadePixel) {
+  uint32_t block[BLOCK_W * BLOCK_H];
+  for (int j = 0; j < BLOCK_H; j++) {
+    for (int i = 0; i < BLOCK_W; i++) {
+      block[(j * BLOCK_W) + i] = shadePixel(x0 + i, y0 + j);
     }
   }
+  for (int j = 0; j < BLOCK_H; j++) {
+    std::copy(&block[j * BLOCK_W], &block[(j + 1) * BLOCK_W], &framebuffer.pixels[((y0 + j) * framebuffer.width) + x0]);
+  }
 }
 
-void drawGeometry(bool filled) {
-  for (uint i = 0; i < gobjects.size(); i++) {
-    for (uint j = 0; j < gobjects.at(i).faces.size(); j++) {
-      CanvasTriangle projectedTriangle = projectTriangleOntoImagePlane(gobjects.at(i).faces.at(j));
-      if (filled) drawFilledTriangle(projectedTriangle);
-      else drawStrokedTriangle(projectedTriangle);
+template <typename PixelShader>
+void rayTraceTile(int tileIndex, PixelShader& shadePixel) {
+  ProfileScope scope(profiler, STAGE_RAY_TILE);
+  int tilesAcross = (screenWidth + TILE_SIZE - 1) / TILE_SIZE;
+  int x0 = (tileIndex % tilesAcross) * TILE_SIZE;
+  int y0 = (tileIndex / tilesAcross) * TILE_SIZE;
+  int x1 = std::min(x0 + TILE_SIZE, screenWidth);
+  int y1 = std::min(y0 + TILE_SIZE, screenHeight);
+
+  if ((x1 - x0 == TILE_SIZE) && (y1 - y0 == TILE_SIZE)) {
+    rayTraceBlock<TILE_SIZE, TILE_SIZE>(x0, y0, shadePixel);
+    return;
+  }
+  for (int j = y0; j < y1; j++) {
+    for (int i = x0; i < x1; i++) {
+      framebuffer.setPixelColour(i, j, shadePixel(i, j));
     }
   }
+}
+
+void updateBVH() {
+  if (sceneChanged) {
+    ProfileScope scope(profiler, STAGE_BVH_BUILD);
+    bvh.build(gobjects);
+    sceneChanged = false;
+  }
+}
 
-  CanvasPoint lightCP = projectVertexInto2D(light.Position);
-  if ((lightCP.x >= 0 && lightCP.x < WIDTH) && (lightCP.y >= 0 && lightCP.y < HEIGHT))
-    window.setPixelColour(lightCP.x, lightCP.y, get_rgb(BLACK));
+template <typename PixelShader>
+void rayTraceTiles(PixelShader shadePixel) {
+  int tilesAcross = (screenWidth + TILE_SIZE - 1) / TILE_SIZE;
+  int tilesDown = (screenHeight + TILE_SIZE - 1) / TILE_SIZE;
+  pool.run(tilesAcross * tilesDown, [&](int tileIndex) {
+    rayTraceTile(tileIndex, shadePixel);
+  });
 }
 
-void clearScreen() {
-  window.clearPixels();
+void drawGeometryViaRayTracing() {
+  updateBVH();
+  ProfileScope scope(profiler, STAGE_RAY_PASS);
+  bvh.resetStats();
+  mat3 adjOrientation(camera.orientation[0], -camera.orientation[1], camera.orientation[2]);
+  rayTraceTiles([&](int i, int j) { return rayTracePixel(i, j, adjOrientation); });
+}
+
+// The second half of a hybrid frame; the visibility buffer must already have
+// been rasterised (see draw())
+void drawGeometryViaVisibilityBuffer() {
+  ProfileScope scope(profiler, STAGE_RAY_PASS);
+  bvh.resetStats();
+  mat3 adjOrientation(camera.orientation[0], -camera.orientation[1], camera.orientation[2]);
+  rayTraceTiles([&](int i, int j) { return shadeVisiblePixel(i, j, adjOrientation); });
+}
+
+// First half of a filled raster pass: projects the scene's triangles into
+// projectedTriangles and bins them by the raster tiles their bounding boxes
+// overlap, a range of BIN_TASK_SIZE triangles per task
+void projectAndBinTriangles() {
+  ProfileScope scope(profiler, STAGE_PROJECTION);
+  // Where each gobject's faces start in scene order
+  vector<int> firstTriangle(gobjects.size() + 1, 0);
+  for (uint i = 0; i < gobjects.size(); i++) {
+    firstTriangle[i + 1] = firstTriangle[i] + gobjects.at(i).mesh.faceCount();
+  }
+  int total = firstTriangle.back();
+  // Room for the two triangles each could clip into; the bins hold indices
+  // into this, 2*sceneTriangle + 0 or 1
+  projectedTriangles.resize(2 * total);
+  vector<char> inView(gobjects.size());
+  for (uint i = 0; i < gobjects.size(); i++) inView[i] = gobjectInView(gobjects.at(i));
+
+  int tilesAcross = (screenWidth + RASTER_TILE_SIZE - 1) / RASTER_TILE_SIZE;
+  int tilesDown = (screenHeight + RASTER_TILE_SIZE - 1) / RASTER_TILE_SIZE;
+  int numTasks = (total + BIN_TASK_SIZE - 1) / BIN_TASK_SIZE;
+  tileBins.reset(tilesAcross, tilesDown, numTasks);
+  rasterBackFacesCulled = 0;
+
+  pool.run(numTasks, [&](int task) {
+    int first = task * BIN_TASK_SIZE;
+    int last = std::min(first + BIN_TASK_SIZE, total);
+    uint g = std::upper_bound(firstTriangle.begin(), firstTriangle.end(), first) - firstTriangle.begin() - 1;
+    unsigned long culled = 0;
+    for (int t = first; t < last; t++) {
+      while (t >= firstTriangle[g + 1]) g++;
+      if (!inView[g]) continue;
+      const Mesh& mesh = gobjects.at(g).mesh;
+      int face = t - firstTriangle[g];
+      if (buf_mode == TEXTURE && !mesh.textured(face)) continue;
+      if (gobjects.at(g).cullBackFaces && isBackFacing(mesh, face)) {
+        culled++;
+        continue;
+      }
+      int count = projectTriangleOntoImagePlane(mesh, face, &projectedTriangles[2 * t]);
+      for (int c = 0; c < count; c++) {
+        const CanvasTriangle& projected = projectedTriangles[(2 * t) + c];
+        // The pixels the triangle could cover, with a pixel to spare for the
+        // rasteriser's rounding. drawFilledTriangle() does the exact test.
+        float lo[2] = {INFINITY, INFINITY}, hi[2] = {-INFINITY, -INFINITY};
+        bool finite = true;
+        for (int k = 0; k < 3; k++) {
+          const CanvasPoint& v = projected.vertices[k];
+          finite = finite && std::isfinite(v.x) && std::isfinite(v.y);
+          lo[0] = std::min(lo[0], v.x);
+          lo[1] = std::min(lo[1], v.y);
+          hi[0] = std::max(hi[0], v.x);
+          hi[1] = std::max(hi[1], v.y);
+        }
+        if (!finite || hi[0] < 0 || hi[1] < 0 || lo[0] >= screenWidth || lo[1] >= screenHeight) continue;
+        int x0 = std::max(0.0f, floorf(lo[0]) - 1) / RASTER_TILE_SIZE;
+        int y0 = std::max(0.0f, floorf(lo[1]) - 1) / RASTER_TILE_SIZE;
+        int x1 = std::min((float)screenWidth - 1, ceilf(hi[0]) + 1) / RASTER_TILE_SIZE;
+        int y1 = std::min((float)screenHeight - 1, ceilf(hi[1]) + 1) / RASTER_TILE_SIZE;
+        for (int ty = y0; ty <= y1; ty++) {
+          for (int tx = x0; tx <= x1; tx++) tileBins.add(task, tx + (ty * tilesAcross), (2 * t) + c);
+        }
+      }
+    }
+    rasterBackFacesCulled.fetch_add(culled, memory_order_relaxed);
+  });
+}
 
-  for(int y=0; y<window.height ;y++) {
-    for(int x=0; x<window.width ;x++) {
-      window.setPixelColour(x, y, get_rgb(WHITE));
+// Second half: draws one tile's triangles in scene order, depth testing
+// against a copy of the tile's part of the depth buffer. Tiles cover
+// disjoint pixels, so any number can be drawn at once without contending,
+// and each comes out the same whichever thread draws it.
+void rasteriseTile(int tileIndex, const vector<int>& storeIndexOf) {
+  ProfileScope scope(profiler, STAGE_RASTER_TILE);
+  static thread_local vector<float> tileDepth(RASTER_TILE_SIZE * RASTER_TILE_SIZE);
+  RasterTarget target;
+  target.x0 = (tileIndex % tileBins.tilesAcross) * RASTER_TILE_SIZE;
+  target.y0 = (tileIndex / tileBins.tilesAcross) * RASTER_TILE_SIZE;
+  target.x1 = std::min(target.x0 + RASTER_TILE_SIZE, screenWidth);
+  target.y1 = std::min(target.y0 + RASTER_TILE_SIZE, screenHeight);
+  target.depth = tileDepth.data();
+  target.depthStride = RASTER_TILE_SIZE;
+
+  // Tiles with nothing to draw leave the depth buffer alone, and so clean
+  if (tileBins.empty(tileIndex)) return;
+  int rowLength = target.x1 - target.x0;
+  if (depthbuf.isDirty(target.x0, target.y0, target.x1, target.y1)) {
+    for (int y = target.y0; y < target.y1; y++) {
+      const float* row = &depthbuf.depthbuf[(y * screenWidth) + target.x0];
+      std::copy(row, row + rowLength, &tileDepth[(y - target.y0) * RASTER_TILE_SIZE]);
     }
   }
+  else std::fill(tileDepth.begin(), tileDepth.end(), 0.0f);
+  tileBins.forEach(tileIndex, [&](int t) {
+    drawFilledTriangle(projectedTriangles[t], target, (buf_mode == VISIBILITY) ? storeIndexOf[t / 2] : -1);
+  });
+  for (int y = target.y0; y < target.y1; y++) {
+    const float* row = &tileDepth[(y - target.y0) * RASTER_TILE_SIZE];
+    std::copy(row, row + rowLength, &depthbuf.depthbuf[(y * screenWidth) + target.x0]);
+  }
+  depthbuf.markDirty(target.x0, target.y0, target.x1, target.y1);
+}
+
+void drawGeometry(bool filled) {
+  ProfileScope scope(profiler, STAGE_RASTER_PASS);
+  if (filled) {
+    projectAndBinTriangles();
+    pool.run(tileBins.tilesAcross * tileBins.tilesDown, [&](int tileIndex) {
+      rasteriseTile(tileIndex, bvh.storeIndexOf);
+    });
+  }
+  else {
+    int sceneTriangle = 0;
+    for (uint i = 0; i < gobjects.size(); i++) {
+      if (!gobjectInView(gobjects.at(i))) {
+        sceneTriangle += gobjects.at(i).mesh.faceCount();
+        continue;
+      }
+      for (int j = 0; j < gobjects.at(i).mesh.faceCount(); j++) {
+        if (buf_mode == VISIBILITY) rasterTriangle = bvh.storeIndexOf[sceneTriangle];
+        sceneTriangle++;
+        CanvasTriangle projected[2];
+        int count;
+        {
+          ProfileScope projectionScope(profiler, STAGE_PROJECTION);
+          count = projectTriangleOntoImagePlane(gobjects.at(i).mesh, j, projected);
+        }
+        for (int c = 0; c < count; c++) drawStrokedTriangle(projected[c]);
+      }
+    }
+  }
+
+  if (getAdjustedVector(light.Position).z >= NEAR_PLANE) {
+    CanvasPoint lightCP = projectVertexInto2D(light.Position);
+    if ((lightCP.x >= 0 && lightCP.x < screenWidth) && (lightCP.y >= 0 && lightCP.y < screenHeight))
+      framebuffer.setPixelColour(lightCP.x, lightCP.y, get_rgb(BLACK));
+  }
+}
+
+// Resizes every per-pixel buffer to the given resolution. Call before the
+// window is opened, which takes its size from screenWidth/screenHeight.
+void setResolution(int w, int h) {
+  screenWidth = w;
+  screenHeight = h;
+  framebuffer = FrameBuffer(w, h);
+  depthbuf = DepthBuffer(w, h);
+  texture_buffer.assign(w * h, 0);
+  visbuf.resize(w, h);
+}
+
+void clearScreen() {
+  framebuffer.fill(get_rgb(WHITE));
 
   depthbuf.clear();
 }
 
+// Opens a profiled frame if profiling is on; it's closed once the frame has
+// been presented or written out (see presentFrame() and renderHeadless())
 void draw() {
+  profiler.beginFrame();
   clearScreen();
   if (current_mode == WIRE) {
     drawGeometry(false);
@@ -710,15 +1503,101 @@ void draw() {
   else if (current_mode == RASTER) {
     drawGeometry(true);
   }
-  else {
+  else if (current_mode == RAY) {
     buf_mode = TEXTURE;
     drawGeometry(true);
     buf_mode = WINDOW;
     drawGeometryViaRayTracing();
   }
+  else {
+    // The raster pass fills in the texture buffer as usual, plus which
+    // triangle is visible at each pixel (by its BVH store index, so the BVH
+    // has to be up to date first)
+    updateBVH();
+    visbuf.clear();
+    buf_mode = VISIBILITY;
+    drawGeometry(true);
+    buf_mode = WINDOW;
+    drawGeometryViaVisibilityBuffer();
+  }
   //camera.printCamera();
 }
 
+bool animationFinished() {
+  return (camera.position.x <= 740.0f || camera.position.x > 4000.0f
+          || camera.position.z <= 740.0f || camera.position.z > 4000.0f);
+}
+
+// Moves the camera, light and teapot on to where they should be for the
+// current frame_no. Nothing moves for the first ten frames.
+void advanceAnimation() {
+  if (frame_no > 10) {
+    if (hasGObject("teapot")) rotateTeaPot(10.0f);
+    float speed = (float)(frame_no / 2) - 5.0f;
+    if (speed > 20.0f) speed = 20.0f;
+    camera.moveAlongAnimArc(-speed);
+    camera.lookAt(getAnimationTarget());
+    light.Position.z += 4.0f;
+    if (light.Position.z > 750.0f) {
+      light.Position.z += 3.5f;
+      light.Position.x -= 4.0f;
+      light.Position.y -= 3.0f;
+      light.Spread -= 0.01f;
+      light.Intensity += 15.0f;
+    }
+  }
+}
+
+// Where a profiled frame's Chrome trace goes: next to its screenshot
+string getTraceFilename() {
+  std::string frame = std::string(5 - to_string(frame_no).length(), '0') + to_string(frame_no);
+  return string(screenshotDir / fs::path("trace-" + frame + ".json"));
+}
+
+// Renders frames firstFrame..lastFrame of the animation into the frame buffer
+// and writes each out as a PPM, without touching SDL. Earlier frames are
+// stepped through (so the camera, light and teapot end up in the right
+// place) but not drawn.
+void renderHeadless(int firstFrame, int lastFrame) {
+  double totalTime = 0.0;
+  int framesDrawn = 0;
+
+  for (frame_no = 0; frame_no <= lastFrame; ) {
+    if (animationFinished()) {
+      cout << "Animation finished before frame " << frame_no << endl;
+      break;
+    }
+    if (frame_no >= firstFrame) {
+      auto start = chrono::steady_clock::now();
+      draw();
+      double drawTime = millisecondsSince(start);
+      writePPM();
+      double frameTime = millisecondsSince(start);
+      profiler.endFrame(frame_no, getTraceFilename());
+      printf("frame %05d: %.1f ms (draw %.1f ms)\n", frame_no, frameTime, drawTime);
+      fflush(stdout);
+      totalTime += frameTime;
+      framesDrawn++;
+    }
+    frame_no++;
+    advanceAnimation();
+  }
+
+  if (framesDrawn > 0) {
+    printf("%d frames in %.1f ms (%.1f ms/frame)\n", framesDrawn, totalTime, totalTime / framesDrawn);
+  }
+}
+
+#ifndef HEADLESS
+void presentFrame() {
+  {
+    ProfileScope scope(profiler, STAGE_RENDER_FRAME);
+    std::copy(framebuffer.pixels.begin(), framebuffer.pixels.end(), window.pixelBuffer);
+    window.renderFrame();
+  }
+  profiler.endFrame(frame_no, getTraceFilename());
+}
+
 void handleFrame() {
   frame_no ++;
   std::cout << "fr_" << frame_no << "; ";
@@ -736,11 +1615,16 @@ void handleEvent(SDL_Event event) {
       writePPM();
     }
     else if(event.key.keysym.sym == SDLK_i) {
-      cout << "I: PRINT INFO" << endl;
+      cout << "I: PRINT INFO, TOGGLE PROFILING" << endl;
       cout << "--------------------------------------------------" << endl;
       camera.printCamera();
       std::cout << "LIGHT position:\n";
       printVec3(light.Position);
+      bvh.printStats();
+      if (current_mode == HYBRID) cout << "  primary rays cast by hybrid fallback: " << visbuf.fallbacks << endl;
+      cout << "Back faces culled by the last raster pass: " << rasterBackFacesCulled << endl;
+      profiler.enabled = !profiler.enabled;
+      cout << "Profiling " << (profiler.enabled ? "on: each frame's summary prints here and its trace goes to " + string(screenshotDir) : "off") << endl;
       cout << "--------------------------------------------------" << endl;
     }
     else if(event.key.keysym.sym == SDLK_b) {
@@ -755,6 +1639,16 @@ void handleEvent(SDL_Event event) {
       cout << "R: DRAW RAYTRACING" << endl;
       current_mode = RAY;
     }
+    else if(event.key.keysym.sym == SDLK_v) {
+      cout << "V: DRAW HYBRID (RASTERISED VISIBILITY, RAYTRACED SHADING)" << endl;
+      current_mode = HYBRID;
+    }
+
+    else if(event.key.keysym.sym == SDLK_m) {
+      textureFilter = (TextureFilter)((textureFilter + 1) % 3);
+      const char* filterNames[] = {"NEAREST", "BILINEAR", "TRILINEAR"};
+      cout << "M: TEXTURE FILTERING " << filterNames[textureFilter] << endl;
+    }
 
     else if(event.key.keysym.sym == SDLK_w) {
       cout << "W: MOVE CAMERA FORWARD" << endl;
@@ -818,7 +1712,7 @@ void handleEvent(SDL_Event event) {
       cout << "J: MOVE ALONG ANIM ARC" << endl;
       // Should be -ve, but whatever
       camera.moveAlongAnimArc(10.0f);
-      camera.lookAt(getCentreOf("logo"));
+      camera.lookAt(getAnimationTarget());
     }
     else if(event.key.keysym.sym == SDLK_t) {
       cout << "T: ROTATE TEAPOT" << endl;
@@ -842,8 +1736,7 @@ void handleEvent(SDL_Event event) {
 
   while (animating) {
 
-    if (camera.position.x <= 740.0f || camera.position.x > 4000.0f
-        || camera.position.z <= 740.0f || camera.position.z > 4000.0f) {
+    if (animationFinished()) {
       //camera.printCamera();
       animating = false;
       for (int i = 0; i < 10; i++) {
@@ -857,69 +1750,815 @@ void handleEvent(SDL_Event event) {
       if (animating) {
         draw();
         handleFrame();
+        advanceAnimation();
+        presentFrame();
+      }
+    }
+  }
+}
+#endif
+
+// Benchmark Functions
+// ---
+// Times just the raytracing pass of a RAY frame (the rasterised texture
+// buffer it reads from is drawn once up front) at 1, 2, 4, 8 and all
+// hardware threads, and checks every frame matches the single-threaded one.
+void benchmarkThreadScaling() {
+  int hardwareThreads = std::max(1u, thread::hardware_concurrency());
+  vector<int> threadCounts = {1, 2, 4, 8};
+  if (find(threadCounts.begin(), threadCounts.end(), hardwareThreads) == threadCounts.end())
+    threadCounts.push_back(hardwareThreads);
+
+  current_mode = RAY;
+  draw();
+  vector<uint32_t> reference;
+  double serialTime = 0.0;
+  const int runs = 3;
+
+  cout << "threads  median_ms  speedup  identical" << endl;
+  for (uint k = 0; k < threadCounts.size(); k++) {
+    pool.setThreadCount(threadCounts[k]);
+    vector<double> times;
+    for (int r = 0; r < runs; r++) {
+      auto start = chrono::steady_clock::now();
+      drawGeometryViaRayTracing();
+      times.push_back(millisecondsSince(start));
+    }
+    sort(times.begin(), times.end());
+    double median = times[runs / 2];
+
+    vector<uint32_t> frame = framebuffer.pixels;
+    if (k == 0) {
+      reference = frame;
+      serialTime = median;
+    }
+    printf("%7d  %9.1f  %7.2f  %s\n", threadCounts[k], median, serialTime / median,
+           (frame == reference) ? "yes" : "NO");
+  }
+}
+
+void printUsage(char* programName) {
+  cout << "Usage: " << programName << " [options]" << endl;
+  cout << "  --headless        render without a window, write the frames and exit" << endl;
+  cout << "  --scene FILE      load a single OBJ file instead of the default scene" << endl;
+  cout << "  --no-cache        load the scene from its OBJ files even if " << SCENE_CACHE_DIR << " has it" << endl;
+  cout << "  --mode MODE       wire, raster, ray or hybrid" << endl;
+  cout << "  --size WxH        output resolution (default 640x480)" << endl;
+  cout << "  --aa N            anti-aliasing samples per pixel for ray mode (hybrid always uses 1)" << endl;
+  cout << "  --frames A[-B]    animation frames to render when headless (default 0)" << endl;
+  cout << "  --out DIR         where to write frames (default " << SCREENSHOT_DIR << ")" << endl;
+  cout << "  --threads N       worker threads for raytracing and rasterising" << endl;
+  cout << "  --profile         print where each frame's time goes and write a Chrome trace of it" << endl;
+  cout << "                    (trace-NNNNN.json) next to the frame; the I key toggles this" << endl;
+  cout << "                    (built with make allocations, it also counts each frame's heap allocations)" << endl;
+  cout << "  --cull NAME       cull the back faces of gobject NAME too (e.g. teapot); repeatable" << endl;
+  cout << "  --cull-rays       let rays skip the back faces of culled gobjects, as the rasteriser does" << endl;
+  cout << "  --filter FILTER   texture filtering: nearest (the default), bilinear or trilinear;" << endl;
+  cout << "                    the M key cycles through them" << endl;
+  cout << "  --simd LEVEL      ray/triangle and rasteriser kernels: scalar, sse or avx2" << endl;
+  cout << "                    (default: best available)" << endl;
+  cout << "  --bench-threads   benchmark raytracing at 1/2/4/8/N threads and exit" << endl;
+  cout << "  --bench-resolution  benchmark each mode's cost per megapixel and exit" << endl;
+  cout << "  --bench-intersect   benchmark the ray/triangle test and exit" << endl;
+  cout << "  --bench-raster      benchmark triangle filling, old scanline path vs. edge functions" << endl;
+  cout << "                      at each SIMD level, and exit" << endl;
+  cout << "  --bench-texture     benchmark texture sampling, magnified and minified, with each filter" << endl;
+  cout << "  --bench-obj FILE    benchmark loading FILE with the old and the memory-mapped OBJ loader," << endl;
+  cout << "                      then parsing it in parallel at 1/2/4/8/N threads, and check they" << endl;
+  cout << "                      all load the same gobjects; exits 1 if any of them don't" << endl;
+  cout << "  --bench-suite FILE  run the benchmark suite, write its results to FILE as JSON" << endl;
+  cout << "                      and check its frames against the reference images" << endl;
+  cout << "  --bench-runs N      frames to time per benchmark suite case (default 5)" << endl;
+  cout << "  --update-references rewrite the suite's reference images instead of checking them" << endl;
+  cout << "  --bench-tolerant    let suite frames differ slightly from their reference images (e.g. when built" << endl;
+  cout << "                      by another compiler or run on another CPU) rather than requiring exact matches" << endl;
+}
+
+// Times a frame of each mode at a range of preview-to-final resolutions and
+// reports the cost per megapixel, which should stay roughly flat if nothing
+// scales worse than the pixel count.
+void benchmarkResolutions() {
+  int resolutions[][2] = {{320, 240}, {640, 480}, {1280, 720}, {1920, 1080}};
+  View_mode modes[] = {WIRE, RASTER, RAY, HYBRID};
+  const char* modeNames[] = {"wire", "raster", "ray", "hybrid"};
+  const int runs = 3;
+
+  cout << "mode     resolution  megapixels  median_ms  ms_per_megapixel" << endl;
+  for (int m = 0; m < 4; m++) {
+    current_mode = modes[m];
+    for (int r = 0; r < 4; r++) {
+      setResolution(resolutions[r][0], resolutions[r][1]);
+      vector<double> times;
+      for (int k = 0; k < runs; k++) {
+        auto start = chrono::steady_clock::now();
+        draw();
+        times.push_back(millisecondsSince(start));
+      }
+      sort(times.begin(), times.end());
+      double median = times[runs / 2];
+      double megapixels = (screenWidth * screenHeight) / 1.0e6;
+      printf("%-7s  %4dx%-5d  %10.3f  %9.1f  %16.1f\n", modeNames[m], screenWidth, screenHeight,
+             megapixels, median, median / megapixels);
+    }
+  }
+}
+
+// Tests a fixed batch of camera rays against every scene triangle, once with
+// the old matrix-inverse test and once with the TriangleStore, and reports
+// the time per ray/triangle test and how often the two disagree.
+void benchmarkIntersection() {
+  if (sceneChanged) {
+    bvh.build(gobjects);
+    sceneChanged = false;
+  }
+  TriangleStore& store = bvh.triangles;
+  mat3 adjOrientation(camera.orientation[0], -camera.orientation[1], camera.orientation[2]);
+  float focalLength = getScaledFocalLength();
+
+  // Rays through pseudo-random pixels, from a fixed seed so runs compare
+  const int numRays = 2000;
+  vector<vec3> rays;
+  unsigned int seed = 12345;
+  for (int r = 0; r < numRays; r++) {
+    seed = (seed * 1664525u) + 1013904223u;
+    int i = (seed >> 8) % screenWidth;
+    seed = (seed * 1664525u) + 1013904223u;
+    int j = (seed >> 8) % screenHeight;
+    rays.push_back(vec3(i - screenWidth / 2, -j + screenHeight / 2, focalLength) * adjOrientation);
+  }
+
+  // Per ray, count the hits and sum the indices of the triangles hit, which
+  // is enough to tell whether the two tests agree without storing every
+  // result from inside the timed loops
+  long numTests = (long)numRays * store.size();
+  vector<long> baselineHits(numRays), baselineSums(numRays), storeHits(numRays), storeSums(numRays);
+
+  // The old test took whole ModelTriangles, so make them up front
+  vector<ModelTriangle> storeTriangles;
+  for (int k = 0; k < store.size(); k++) storeTriangles.push_back(store.source[k].mesh->face(store.source[k].face));
+
+  auto start = chrono::steady_clock::now();
+  for (int r = 0; r < numRays; r++) {
+    long count = 0, sum = 0;
+    for (int k = 0; k < store.size(); k++) {
+      RayTriangleIntersection res = getPossibleIntersection(storeTriangles[k], rays[r], camera.position);
+      if (res.isSolution) {
+        count++;
+        sum += k;
+      }
+    }
+    baselineHits[r] = count;
+    baselineSums[r] = sum;
+  }
+  double baselineTime = millisecondsSince(start);
+
+  start = chrono::steady_clock::now();
+  for (int r = 0; r < numRays; r++) {
+    long count = 0, sum = 0;
+    for (int k = 0; k < store.size(); k++) {
+      float t, u, v;
+      if (store.intersect(k, camera.position, rays[r], numeric_limits<float>::infinity(), t, u, v)) {
+        count++;
+        sum += k;
+      }
+    }
+    storeHits[r] = count;
+    storeSums[r] = sum;
+  }
+  double storeTime = millisecondsSince(start);
+
+  long hits = 0, mismatches = 0;
+  for (int r = 0; r < numRays; r++) {
+    hits += storeHits[r];
+    if (storeHits[r] != baselineHits[r] || storeSums[r] != baselineSums[r]) mismatches++;
+  }
+
+  printf("%ld ray/triangle tests (%d rays x %d triangles), %ld hits\n", numTests, numRays, store.size(), hits);
+  printf("matrix inverse:    %8.2f ns/test\n", (baselineTime * 1.0e6) / numTests);
+  printf("moller-trumbore:   %8.2f ns/test\n", (storeTime * 1.0e6) / numTests);
+  printf("speedup:           %8.2fx\n", baselineTime / storeTime);
+  printf("rays that disagree: %7ld\n", mismatches);
+
+  // The same tests a batch of eight at a time, through each intersect8
+  // kernel this CPU can run
+  SimdLevel best = store.simdLevel;
+  for (int level = SIMD_SCALAR; level <= detectSimdLevel(); level++) {
+    store.simdLevel = (SimdLevel)level;
+    start = chrono::steady_clock::now();
+    for (int r = 0; r < numRays; r++) {
+      long count = 0, sum = 0;
+      float t[TriangleStore::BATCH], u[TriangleStore::BATCH], v[TriangleStore::BATCH];
+      for (int k = 0; k < store.size(); k += TriangleStore::BATCH) {
+        int n = std::min(TriangleStore::BATCH, store.size() - k);
+        unsigned mask = store.intersect8(k, n, camera.position, rays[r], numeric_limits<float>::infinity(), t, u, v);
+        for (int b = 0; mask != 0; b++, mask >>= 1) {
+          if (mask & 1) {
+            count++;
+            sum += k + b;
+          }
+        }
+      }
+      storeHits[r] = count;
+      storeSums[r] = sum;
+    }
+    double batchTime = millisecondsSince(start);
+
+    mismatches = 0;
+    for (int r = 0; r < numRays; r++) {
+      if (storeHits[r] != baselineHits[r] || storeSums[r] != baselineSums[r]) mismatches++;
+    }
+    string name = "x8 " + simdLevelName((SimdLevel)level) + ":";
+    printf("%-19s%8.2f ns/test  %6.2fx  (%ld rays disagree)\n", name.c_str(),
+      (batchTime * 1.0e6) / numTests, baselineTime / batchTime, mismatches);
+  }
+  store.simdLevel = best;
+}
+
+// Fills the scene's projected triangles into the frame buffer with the old
+// scanline path and the edge-function rasteriser (with its blocks of pixels
+// done by each SIMD level this CPU has), at the scene's own triangle sizes
+// and again with every triangle split into 16 (which is mostly per-triangle
+// overhead), and reports triangles/sec for each and how many pixels each
+// disagrees with the scanline path on.
+void benchmarkRasteriser() {
+  const int runs = 5;
+  SimdLevel best = blockRaster.simdLevel;
+  vector<string> pathNames = {"scanline"};
+  for (int level = SIMD_SCALAR; level <= detectSimdLevel(); level++) {
+    pathNames.push_back("edge " + simdLevelName((SimdLevel)level));
+  }
+  cout << "triangles  path            median_ms  triangles/sec  speedup  pixels_differing" << endl;
+  for (int levels = 0; levels <= 2; levels += 2) {
+    subdivideGObjects(levels);
+    vector<CanvasTriangle> projected;
+    for (uint i = 0; i < gobjects.size(); i++) {
+      for (int j = 0; j < gobjects.at(i).mesh.faceCount(); j++) {
+        CanvasTriangle clipped[2];
+        int count = projectTriangleOntoImagePlane(gobjects.at(i).mesh, j, clipped);
+        projected.insert(projected.end(), clipped, clipped + count);
+      }
+    }
+
+    buf_mode = WINDOW;
+    vector<uint32_t> baseline;
+    double baselineMedian = 0.0;
+    for (uint path = 0; path < pathNames.size(); path++) {
+      if (path > 0) blockRaster.simdLevel = (SimdLevel)(path - 1);
+      vector<double> times;
+      for (int r = 0; r < runs; r++) {
+        clearScreen();
+        auto start = chrono::steady_clock::now();
+        for (uint t = 0; t < projected.size(); t++) {
+          if (path == 0) drawFilledTriangleScanline(projected[t]);
+          else drawFilledTriangle(projected[t]);
+        }
+        times.push_back(millisecondsSince(start));
+      }
+      sort(times.begin(), times.end());
+      double median = times[runs / 2];
+      if (path == 0) {
+        baseline = framebuffer.pixels;
+        baselineMedian = median;
+      }
 
-        if (frame_no > 10) {
-          rotateTeaPot(10.0f);
-          float speed = (float)(frame_no / 2) - 5.0f;
-          if (speed > 20.0f) speed = 20.0f;
-          camera.moveAlongAnimArc(-speed);
-          camera.lookAt(getCentreOf("logo"));
-          light.Position.z += 4.0f;
-          if (light.Position.z > 750.0f) {
-            light.Position.z += 3.5f;
-            light.Position.x -= 4.0f;
-            light.Position.y -= 3.0f;
-            light.Spread -= 0.01f;
-            light.Intensity += 15.0f;
+      int differing = 0;
+      for (uint i = 0; i < baseline.size(); i++) {
+        if ((baseline[i] & 0xffffff) != (framebuffer.pixels[i] & 0xffffff)) differing++;
+      }
+      printf("%9zu  %-14s  %9.2f  %13.0f  %7.2f  %s\n", projected.size(), pathNames[path].c_str(), median,
+             (projected.size() * 1000.0) / median, baselineMedian / median,
+             (path > 0) ? to_string(differing).c_str() : "");
+    }
+  }
+  blockRaster.simdLevel = best;
+}
+
+// Samples a 4096x4096 texture of noise across a 512x512 grid of pixels:
+// magnified (a pixel a quarter of a texel across), one to one, and minified
+// (3 texels across), with the grid turned 30 degrees so it doesn't follow the image's
+// rows. "row-major" is the old way: the nearest texel of a plain row-major
+// image; the rest sample the tiled mip chain with each filter. Reports
+// texture samples per second.
+void benchmarkTextures() {
+  const int size = 4096, grid = 512, runs = 5;
+  vector<uint32_t> image(size * size);
+  unsigned int seed = 12345;
+  for (uint i = 0; i < image.size(); i++) {
+    seed = (seed * 1664525u) + 1013904223u;
+    image[i] = (seed >> 8) & 0xffffff;
+  }
+  Texture texture(size, size, image);
+
+  const char* sampling[] = {"magnified", "1:1", "minified"};
+  const float scales[] = {0.25f, 1.0f, 3.0f};
+  const char* pathNames[] = {"row-major", "nearest", "bilinear", "trilinear"};
+  const TextureFilter filters[] = {FILTER_NEAREST, FILTER_NEAREST, FILTER_BILINEAR, FILTER_TRILINEAR};
+  cout << "sampling   filter      median_ms   samples/sec  vs_row_major" << endl;
+  for (int m = 0; m < 3; m++) {
+    float c = cos(M_PI / 6) * scales[m], s = sin(M_PI / 6) * scales[m];
+    float lod = Texture::lodFor(c, s, -s, c);
+    double baselineMedian = 0.0;
+    for (int path = 0; path < 4; path++) {
+      vector<double> times;
+      uint32_t checksum = 0;
+      for (int r = 0; r < runs; r++) {
+        auto start = chrono::steady_clock::now();
+        for (int j = 0; j < grid; j++) {
+          for (int i = 0; i < grid; i++) {
+            float u = (size / 2) + ((i - (grid / 2)) * c) - ((j - (grid / 2)) * s);
+            float v = (size / 2) + ((i - (grid / 2)) * s) + ((j - (grid / 2)) * c);
+            if (path == 0) {
+              int tx = std::clamp((int)round(u), 0, size - 1);
+              int ty = std::clamp((int)round(v), 0, size - 1);
+              checksum += image[tx + (ty * size)];
+            }
+            else checksum += texture.sample(u, v, lod, filters[path]);
           }
         }
+        times.push_back(millisecondsSince(start));
+      }
+      sort(times.begin(), times.end());
+      double median = times[runs / 2];
+      if (path == 0) baselineMedian = median;
+      printf("%-9s  %-10s  %9.2f  %12.0f  %11.2fx  (checksum %08x)\n", sampling[m], pathNames[path], median,
+             (grid * grid * 1000.0) / median, baselineMedian / median, checksum);
+    }
+  }
+}
 
-        window.renderFrame();
+// Whether two loads of an OBJ gave exactly the same gobjects: names,
+// colours, vertices and texture coordinates, all in the same order
+bool sameGObjects(const vector<GObject>& a, const vector<GObject>& b) {
+  auto sameColour = [](const Colour& x, const Colour& y) {
+    return x.name == y.name && x.red == y.red && x.green == y.green && x.blue == y.blue;
+  };
+  if (a.size() != b.size()) return false;
+  for (uint g = 0; g < a.size(); g++) {
+    if (a[g].name != b[g].name || !sameColour(a[g].colour, b[g].colour)) return false;
+    if (a[g].mesh.faceCount() != b[g].mesh.faceCount()) return false;
+    for (int f = 0; f < a[g].mesh.faceCount(); f++) {
+      const ModelTriangle x = a[g].mesh.face(f);
+      const ModelTriangle y = b[g].mesh.face(f);
+      if (!sameColour(x.colour, y.colour)) return false;
+      for (int k = 0; k < 3; k++) {
+        if (x.vertices[k] != y.vertices[k]) return false;
+      }
+      if (x.maybeTextureTriangle.has_value() != y.maybeTextureTriangle.has_value()) return false;
+      if (x.maybeTextureTriangle) {
+        const TextureTriangle& tx = x.maybeTextureTriangle.value();
+        const TextureTriangle& ty = y.maybeTextureTriangle.value();
+        if (tx.texture != ty.texture) return false;
+        for (int k = 0; k < 3; k++) {
+          if (tx.vertices[k] != ty.vertices[k]) return false;
+        }
       }
     }
   }
+  return true;
 }
 
-int main(int argc, char* argv[]) {
-  // Initialise globals here, not at top of file, because there, statements
-  // are not allowed (so no print statements, or anything, basically)
-  readOBJs();
+// Whether each gobject's first face has the vertices and texture vertices
+// that the first face of its object in obj has, as the file gave them. This
+// checks the meshes against the OBJ itself rather than against another
+// loader's meshes, which are built the same way.
+bool sameFirstFaces(const OBJ_Mesh& obj, const vector<GObject>& gobjects) {
+  for (const GObject& gobject : gobjects) {
+    const Mesh& mesh = gobject.mesh;
+    if (mesh.faceCount() == 0) continue;
+    int o = find(obj.objectNames.begin(), obj.objectNames.end(), gobject.name) - obj.objectNames.begin();
+    int t = find(obj.triangleObjects.begin(), obj.triangleObjects.end(), o) - obj.triangleObjects.begin();
+    if (t == obj.triangleCount()) return false;
+    for (int k = 0; k < 3; k++) {
+      if (mesh.vertex(0, k) != obj.vertices[obj.vertexIndices[(3 * t) + k]]) return false;
+      if (!mesh.textured(0)) continue;
+      int vt = obj.textureIndices[(3 * t) + k];
+      if (vt < 0 || mesh.textureVertex(0, k) != obj.textureVertices[vt]) return false;
+    }
+  }
+  return true;
+}
 
-  for(uint i = 0; i < gobjects.size(); i++) {
-    if ((gobjects.at(i)).name == "logo") {
-      translateGObject(vec3(0.0, 150.0, 700.0), (gobjects.at(i)));
-      vec3 avgLogo = getCentreOf("logo");
-      camera.position[1] = avgLogo[1];
-      camera.position[2] = avgLogo[2];
+// Loads an OBJ file with the original istream loader and the memory-mapped
+// parser, reports how long each takes and how many MB/s of the file that
+// is, and checks they made identical gobjects, whose first faces match the
+// file. Then times the parallel parse at 1/2/4/8/N threads, checking each
+// gives the same mesh as the serial one and (at N threads) the same
+// gobjects as the original loader. Returns false if any check fails.
+bool benchmarkObj(string filename) {
+  const int runs = 3;
+  double megabytes = fs::file_size(filename) / (1024.0 * 1024.0);
+  TextureRegistry benchTextures;
+  vector<GObject> reference, parsed;
+
+  cout << "loader      median_ms     MB/s  triangles" << endl;
+  const char* loaderNames[] = {"reference", "mmap"};
+  for (int loader = 0; loader < 2; loader++) {
+    vector<double> times;
+    for (int r = 0; r < runs; r++) {
+      auto start = chrono::steady_clock::now();
+      if (loader == 0) reference = obj_io.loadOBJReference(filename, benchTextures);
+      else parsed = obj_io.loadOBJ(filename, benchTextures);
+      times.push_back(millisecondsSince(start));
+    }
+    sort(times.begin(), times.end());
+    double median = times[runs / 2];
+    size_t triangles = 0;
+    for (const GObject& g : (loader == 0) ? reference : parsed) triangles += g.mesh.faceCount();
+    printf("%-10s  %9.1f  %7.1f  %9zu\n", loaderNames[loader], median, (megabytes * 1000.0) / median, triangles);
+  }
+  bool allSame = sameGObjects(reference, parsed);
+  cout << "Identical gobjects: " << (allSame ? "yes" : "NO") << endl;
+  size_t meshBytes = 0, faces = 0;
+  for (const GObject& g : parsed) {
+    meshBytes += g.mesh.bytes();
+    faces += g.mesh.faceCount();
+  }
+  printf("Bytes per triangle: %zu as ModelTriangles, %.1f as indexed meshes\n", sizeof(ModelTriangle),
+         (double)meshBytes / std::max<size_t>(faces, 1));
+
+  OBJ_Mesh serial;
+  OBJ_Parser().parse(filename, serial);
+  bool firstFaces = sameFirstFaces(serial, parsed);
+  allSame = allSame && firstFaces;
+  cout << "First faces match the file: " << (firstFaces ? "yes" : "NO") << endl;
+  auto sameMesh = [&](const OBJ_Mesh& mesh) {
+    return mesh.vertices == serial.vertices && mesh.textureVertices == serial.textureVertices &&
+           mesh.vertexIndices == serial.vertexIndices && mesh.textureIndices == serial.textureIndices &&
+           mesh.objectMaterials == serial.objectMaterials && mesh.objectNames == serial.objectNames &&
+           mesh.triangleObjects == serial.triangleObjects && mesh.mtlLibFileName == serial.mtlLibFileName;
+  };
+
+  int originalThreads = pool.size();
+  vector<int> threadCounts = {1, 2, 4, 8};
+  if (find(threadCounts.begin(), threadCounts.end(), originalThreads) == threadCounts.end()) {
+    threadCounts.push_back(originalThreads);
+  }
+  cout << endl << "threads  parse_ms     MB/s  speedup  same_mesh" << endl;
+  double oneThread = 0.0;
+  for (int threads : threadCounts) {
+    pool.setThreadCount(threads);
+    vector<double> times;
+    bool same = true;
+    for (int r = 0; r < runs; r++) {
+      OBJ_Mesh mesh;
+      auto start = chrono::steady_clock::now();
+      OBJ_Parser().parseParallel(filename, mesh, pool);
+      times.push_back(millisecondsSince(start));
+      same = same && sameMesh(mesh);
+    }
+    allSame = allSame && same;
+    sort(times.begin(), times.end());
+    double median = times[runs / 2];
+    if (threads == 1) oneThread = median;
+    printf("%7d  %8.1f  %7.1f  %6.2fx  %s\n", threads, median, (megabytes * 1000.0) / median,
+           oneThread / median, same ? "yes" : "NO");
+  }
+  pool.setThreadCount(originalThreads);
+  parsed = obj_io.loadOBJ(filename, benchTextures, &pool);
+  bool parallelSame = sameGObjects(reference, parsed);
+  allSame = allSame && parallelSame;
+  cout << "Identical gobjects (parallel, " << originalThreads << " threads): "
+       << (parallelSame ? "yes" : "NO") << endl;
+  return allSame;
+}
+
+// The benchmark suite: every view mode, from a fixed set of scenes and camera
+// poses. Each case is timed over several frames at the current resolution,
+// and one frame at BENCH_REFERENCE_WIDTH x BENCH_REFERENCE_HEIGHT is
+// compared against the reference image in BENCH_REFERENCE_DIR. A frame only
+// matches if every pixel is the same, so any change to the output shows up
+// and needs the references updating. With tolerant set, small differences
+// (e.g. from a different compiler or CPU, with -ffast-math) are allowed
+// instead. Results go to jsonFile; returns false if any frame doesn't match.
+#define BENCH_REFERENCE_DIR "./bench/reference/"
+#define BENCH_REFERENCE_WIDTH 160
+#define BENCH_REFERENCE_HEIGHT 120
+// When tolerant, a pixel only counts as different if no reference pixel in
+// the 3x3 block around it is within this much in every channel (so edges or
+// texels shifted by a pixel don't count)...
+#define BENCH_CHANNEL_TOLERANCE 16
+// ...and a frame matches if no more than this fraction of its pixels differ
+#define BENCH_PIXEL_TOLERANCE 0.01
+
+struct BenchScene {
+  string name;
+  string file;      // empty for the default scene
+  int subdivisions; // see subdivideGObjects()
+};
+
+struct BenchPose {
+  string name;
+  int frame;        // how far into the animation to step the camera
+};
+
+double percentile(vector<double> samples, double fraction) {
+  sort(samples.begin(), samples.end());
+  int rank = (int)ceil(fraction * samples.size()) - 1;
+  return samples[std::clamp(rank, 0, (int)samples.size() - 1)];
+}
+
+bool coloursClose(uint32_t a, uint32_t b) {
+  for (int shift = 0; shift <= 16; shift += 8) {
+    int diff = (int)((a >> shift) & 0xff) - (int)((b >> shift) & 0xff);
+    if (abs(diff) > BENCH_CHANNEL_TOLERANCE) return false;
+  }
+  return true;
+}
+
+// Pixels that aren't exactly the same as the reference's
+int countChangedPixels(const vector<uint32_t>& frame, const vector<uint32_t>& reference) {
+  int count = 0;
+  for (uint i = 0; i < frame.size(); i++) count += (frame[i] != reference[i]);
+  return count;
+}
 
-      light.Position = avgLogo;
-      light.Position.z = 500.0f;
+// Pixels that differ by more than the tolerance (see BENCH_CHANNEL_TOLERANCE)
+int countDifferingPixels(const vector<uint32_t>& frame, const vector<uint32_t>& reference, int width, int height) {
+  int count = 0;
+  for (int y = 0; y < height; y++) {
+    for (int x = 0; x < width; x++) {
+      bool close = false;
+      for (int ny = std::max(0, y - 1); ny <= std::min(height - 1, y + 1) && !close; ny++) {
+        for (int nx = std::max(0, x - 1); nx <= std::min(width - 1, x + 1) && !close; nx++) {
+          close = coloursClose(frame[(y * width) + x], reference[(ny * width) + nx]);
+        }
+      }
+      if (!close) count++;
     }
-    // if ((gobjects.at(i)).name == "teapot") {
-    //   rotateGObjectAboutYInPlace(225.0f, gobjects.at(i));
-    // }
+  }
+  return count;
+}
 
+bool runBenchmarkSuite(string jsonFile, int runs, bool updateReferences, bool tolerant) {
+  vector<BenchScene> scenes = {
+    {"cornell-box", "cornell-box.obj", 0},
+    {"jamdy-logo-teapot", "", 0},
+    {"subdivided-x64", "", 3}
+  };
+  vector<BenchPose> poses = {{"start", 0}, {"orbit", 40}};
+  View_mode modes[] = {WIRE, RASTER, RAY, HYBRID};
+  const char* modeNames[] = {"wire", "raster", "ray", "hybrid"};
+  int width = screenWidth, height = screenHeight;
+  bool allMatch = true;
+  fs::create_directories(BENCH_REFERENCE_DIR);
+
+  FILE* json = fopen(jsonFile.c_str(), "w");
+  if (json == NULL) {
+    cout << "Could not open " << jsonFile << endl;
+    return false;
   }
+  fprintf(json, "{\n  \"resolution\": \"%dx%d\",\n  \"threads\": %d,\n  \"simd\": \"%s\",\n  \"runs\": %d,\n  \"cases\": [",
+          width, height, pool.size(), simdLevelName(bvh.triangles.simdLevel).c_str(), runs);
+
+  printf("%-18s %-6s %-7s %9s  %9s  %9s  %12s  %12s  %s\n", "scene", "pose", "mode", "triangles",
+         "median_ms", "p95_ms", "rays/s", "triangles/s", "reference");
+  bool firstCase = true;
+  for (uint s = 0; s < scenes.size(); s++) {
+    for (uint p = 0; p < poses.size(); p++) {
+      loadScene(scenes[s].file);
+      subdivideGObjects(scenes[s].subdivisions);
+      for (frame_no = 0; frame_no < poses[p].frame; frame_no++) advanceAnimation();
+      long triangles = 0;
+      for (uint i = 0; i < gobjects.size(); i++) triangles += gobjects.at(i).mesh.faceCount();
+
+      for (int m = 0; m < 4; m++) {
+        current_mode = modes[m];
+
+        setResolution(width, height);
+        vector<double> times;
+        unsigned long rays = 0;
+        for (int r = 0; r < runs; r++) {
+          auto start = chrono::steady_clock::now();
+          draw();
+          times.push_back(millisecondsSince(start));
+          rays += bvh.raysCast;
+        }
+        double median = percentile(times, 0.5);
+        double p95 = percentile(times, 0.95);
+        double total = 0.0;
+        for (uint r = 0; r < times.size(); r++) total += times[r];
+        double raysPerSecond = (current_mode == RAY || current_mode == HYBRID) ? (rays * 1000.0) / total : 0.0;
+        double trianglesPerSecond = (triangles * runs * 1000.0) / total;
+
+        setResolution(BENCH_REFERENCE_WIDTH, BENCH_REFERENCE_HEIGHT);
+        draw();
+        string caseName = scenes[s].name + "-" + poses[p].name + "-" + modeNames[m];
+        fs::path referenceFile = fs::path(BENCH_REFERENCE_DIR) / (caseName + ".ppm");
+        string result;
+        int changed = -1, differing = -1;
+        vector<uint32_t> reference;
+        int refWidth, refHeight;
+        if (updateReferences) {
+          writePPM(referenceFile);
+          result = "updated";
+        }
+        else if (!readPPM(referenceFile, reference, refWidth, refHeight)) {
+          result = "missing";
+          allMatch = false;
+        }
+        else if (refWidth != framebuffer.width || refHeight != framebuffer.height) {
+          result = "wrong size";
+          allMatch = false;
+        }
+        else {
+          vector<uint32_t> frame(framebuffer.pixels.size());
+          for (uint i = 0; i < frame.size(); i++) frame[i] = framebuffer.pixels[i] & 0xffffff;
+          changed = countChangedPixels(frame, reference);
+          differing = countDifferingPixels(frame, reference, refWidth, refHeight);
+          bool match = tolerant ? (differing <= BENCH_PIXEL_TOLERANCE * frame.size()) : (changed == 0);
+          result = match ? "match" : "MISMATCH";
+          allMatch = allMatch && match;
+        }
+
+        printf("%-18s %-6s %-7s %9ld  %9.1f  %9.1f  %12.0f  %12.0f  %s", scenes[s].name.c_str(), poses[p].name.c_str(),
+               modeNames[m], triangles, median, p95, raysPerSecond, trianglesPerSecond, result.c_str());
+        if (changed >= 0) printf(" (%d pixels changed, %d beyond tolerance)", changed, differing);
+        printf("\n");
+        fflush(stdout);
+
+        fprintf(json, "%s\n    {\"scene\": \"%s\", \"pose\": \"%s\", \"mode\": \"%s\", \"triangles\": %ld, "
+                "\"median_ms\": %.3f, \"p95_ms\": %.3f, \"rays_per_sec\": %.0f, \"triangles_per_sec\": %.0f, "
+                "\"reference\": \"%s\", \"changed_pixels\": %d, \"differing_pixels\": %d}",
+                firstCase ? "" : ",", scenes[s].name.c_str(), poses[p].name.c_str(), modeNames[m], triangles,
+                median, p95, raysPerSecond, trianglesPerSecond, result.c_str(), changed, differing);
+        firstCase = false;
+      }
+    }
+  }
+  fprintf(json, "\n  ],\n  \"all_match\": %s\n}\n", allMatch ? "true" : "false");
+  fclose(json);
+  setResolution(width, height);
+
+  cout << "Results written to " << jsonFile << endl;
+  if (!allMatch) cout << "Some frames don't match their reference images" << endl;
+  return allMatch;
+}
+
+int main(int argc, char* argv[]) {
+  int threadCount = std::max(1u, thread::hardware_concurrency());
+  bool benchThreads = false;
+  bool benchResolution = false;
+  bool benchIntersect = false;
+  bool benchRaster = false;
+  bool benchTexture = false;
+  string benchObjFile;
+  string benchSuiteFile;
+  int benchRuns = 5;
+  bool updateReferences = false;
+  bool tolerantReferences = false;
+  int width = REFERENCE_WIDTH, height = REFERENCE_HEIGHT;
+  SimdLevel simdLevel = detectSimdLevel();
+#ifdef HEADLESS
+  bool headless = true;
+#else
+  bool headless = false;
+#endif
+  string sceneFile;
+  View_mode startMode = WIRE;
+  int firstFrame = 0, lastFrame = 0;
+  screenshotDir = SCREENSHOT_DIR;
+
+  for (int a = 1; a < argc; a++) {
+    string arg = argv[a];
+    bool hasValue = (a + 1 < argc);
+    if (arg == "--threads" && hasValue) threadCount = atoi(argv[++a]);
+    else if (arg == "--simd" && hasValue) {
+      string level = argv[++a];
+      if (level == "scalar") simdLevel = SIMD_SCALAR;
+      else if (level == "sse") simdLevel = SIMD_SSE;
+      else if (level == "avx2") simdLevel = SIMD_AVX2;
+      else {
+        printUsage(argv[0]);
+        exit(1);
+      }
+      if (simdLevel > detectSimdLevel()) {
+        cout << "This CPU doesn't support " << level << ", using " << simdLevelName(detectSimdLevel()) << endl;
+        simdLevel = detectSimdLevel();
+      }
+    }
+    else if (arg == "--filter" && hasValue) {
+      string filter = argv[++a];
+      if (filter == "nearest") textureFilter = FILTER_NEAREST;
+      else if (filter == "bilinear") textureFilter = FILTER_BILINEAR;
+      else if (filter == "trilinear") textureFilter = FILTER_TRILINEAR;
+      else {
+        printUsage(argv[0]);
+        exit(1);
+      }
+    }
+    else if (arg == "--bench-threads") benchThreads = true;
+    else if (arg == "--bench-resolution") benchResolution = true;
+    else if (arg == "--bench-intersect") benchIntersect = true;
+    else if (arg == "--bench-raster") benchRaster = true;
+    else if (arg == "--bench-texture") benchTexture = true;
+    else if (arg == "--bench-obj" && hasValue) benchObjFile = argv[++a];
+    else if (arg == "--bench-suite" && hasValue) benchSuiteFile = argv[++a];
+    else if (arg == "--bench-runs" && hasValue) benchRuns = std::max(1, atoi(argv[++a]));
+    else if (arg == "--update-references") updateReferences = true;
+    else if (arg == "--bench-tolerant") tolerantReferences = true;
+    else if (arg == "--headless") headless = true;
+    else if (arg == "--no-cache") useSceneCache = false;
+    else if (arg == "--profile") profiler.enabled = true;
+    else if (arg == "--cull-rays") bvh.triangles.cullBackFaces = true;
+    else if (arg == "--cull" && hasValue) closedGObjects.push_back(argv[++a]);
+    else if (arg == "--scene" && hasValue) sceneFile = argv[++a];
+    else if (arg == "--out" && hasValue) screenshotDir = argv[++a];
+    else if (arg == "--aa" && hasValue) number_of_AA_samples = std::max(1, atoi(argv[++a]));
+    else if (arg == "--mode" && hasValue) {
+      string mode = argv[++a];
+      if (mode == "wire") startMode = WIRE;
+      else if (mode == "raster") startMode = RASTER;
+      else if (mode == "ray") startMode = RAY;
+      else if (mode == "hybrid") startMode = HYBRID;
+      else {
+        printUsage(argv[0]);
+        exit(1);
+      }
+    }
+    else if (arg == "--size" && hasValue) {
+      if (sscanf(argv[++a], "%dx%d", &width, &height) != 2 || width <= 0 || height <= 0) {
+        printUsage(argv[0]);
+        exit(1);
+      }
+    }
+    else if (arg == "--frames" && hasValue) {
+      int matched = sscanf(argv[++a], "%d-%d", &firstFrame, &lastFrame);
+      if (matched == 1) lastFrame = firstFrame;
+      if (matched < 1 || firstFrame < 0 || lastFrame < firstFrame) {
+        printUsage(argv[0]);
+        exit(1);
+      }
+    }
+    else {
+      printUsage(argv[0]);
+      exit(1);
+    }
+  }
+  pool.setThreadCount(threadCount);
+  bvh.triangles.simdLevel = simdLevel;
+  blockRaster.simdLevel = simdLevel;
+
+  // Initialise globals here, not at top of file, because there, statements
+  // are not allowed (so no print statements, or anything, basically)
+  loadScene(sceneFile);
 
   for (auto g=gobjects.begin(); g != gobjects.end(); g++) {
     cout << "Object " << (*g).name << " is centered at ";
-    printVec3(averageVerticesOfFaces((*g).faces));
+    printVec3(averageVerticesOfFaces((*g).mesh));
   }
 
-  texture_buffer = (uint32_t*)malloc(WIDTH*HEIGHT*sizeof(uint32_t));
-  window = DrawingWindow(WIDTH, HEIGHT, false);
-  depthbuf = DepthBuffer(WIDTH, HEIGHT);
+  setResolution(width, height);
   buf_mode = WINDOW;
-  current_mode = WIRE;
-  screenshotDir = SCREENSHOT_DIR;
-  fs::create_directory(screenshotDir); // ensure it exists
+  current_mode = startMode;
+  fs::create_directories(screenshotDir); // ensure it exists
+
+  if (benchThreads) {
+    benchmarkThreadScaling();
+    return 0;
+  }
+
+  if (benchResolution) {
+    benchmarkResolutions();
+    return 0;
+  }
+
+  if (benchIntersect) {
+    benchmarkIntersection();
+    return 0;
+  }
+
+  if (benchRaster) {
+    benchmarkRasteriser();
+    return 0;
+  }
+
+  if (benchTexture) {
+    benchmarkTextures();
+    return 0;
+  }
+
+  if (!benchObjFile.empty()) {
+    return benchmarkObj(benchObjFile) ? 0 : 1;
+  }
+
+  if (!benchSuiteFile.empty()) {
+    return runBenchmarkSuite(benchSuiteFile, benchRuns, updateReferences, tolerantReferences) ? 0 : 1;
+  }
 
+  if (headless) {
+    renderHeadless(firstFrame, lastFrame);
+    return 0;
+  }
+
+#ifndef HEADLESS
+  window = DrawingWindow(screenWidth, screenHeight, false);
   SDL_Event event;
 
   draw();
 
   while(true) {
     if(window.pollForInputEvents(&event)) handleEvent(event);
-    window.renderFrame();
+    presentFrame();
   }
+#endif
 }
@@ -0,0 +1,274 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cstring>
+#include <cstdint>
+#include <sys/stat.h>
+#include "OBJ_Parser.hpp"
+#include "TextureRegistry.hpp"
+#include "BVH.hpp"
+
+using namespace std;
+using namespace glm;
+
+// A loaded scene saved in a binary file, so the next run can skip parsing
+// its OBJ and MTL files and building its BVH. Each scene (named by the file
+// it was loaded from) has a file of its own in the cache directory, which
+// holds:
+//   - the source files' sizes and modification times, so it's only used
+//     while they're unchanged;
+//   - the textures' filenames, in handle order, to load them back into the
+//     same handles;
+//   - the materials, in id order, to find their ids in this run's
+//     MaterialTable;
+//   - each gobject's name and colour, and its mesh's arrays as they are in
+//     memory (vertices as loaded and scaled);
+//   - the BVH's nodes and triangle order.
+// The file is memory-mapped to load it.
+class SceneCache {
+  public:
+    SceneCache () {}
+
+    SceneCache (string dir) {
+      directory = dir;
+    }
+
+    // Reads the scene saved as name, if its sources haven't changed since,
+    // into gobjects and textures (which should both be empty). nodes and
+    // order are for BVH::restore(). Returns false if there isn't a usable
+    // one.
+    bool load(const string& name, vector<GObject>& gobjects, TextureRegistry& textures,
+              vector<BVHNode>& nodes, vector<int>& order) {
+      MappedFile file(pathFor(name));
+      if (!file.ok() || file.size == 0) return false;
+      Reader in(file.data, file.data + file.size);
+
+      char magic[sizeof(MAGIC)];
+      uint32_t version;
+      if (!in.read(magic, sizeof(magic)) || memcmp(magic, MAGIC, sizeof(MAGIC)) != 0) return false;
+      if (!in.read(version) || version != VERSION) return false;
+      string savedName;
+      if (!in.read(savedName) || savedName != name) return false;
+
+      uint32_t numSources;
+      if (!in.read(numSources)) return false;
+      for (uint32_t s = 0; s < numSources; s++) {
+        string source;
+        int64_t size, modified;
+        if (!in.read(source) || !in.read(size) || !in.read(modified)) return false;
+        int64_t currentSize, currentModified;
+        if (!fileStamp(source, currentSize, currentModified)) return false;
+        if (currentSize != size || currentModified != modified) return false;
+      }
+
+      uint32_t numTextures;
+      if (!in.read(numTextures)) return false;
+      vector<string> textureFiles(numTextures);
+      for (uint32_t t = 0; t < numTextures; t++) {
+        if (!in.read(textureFiles[t])) return false;
+      }
+
+      uint32_t numMaterials;
+      if (!in.read(numMaterials) || numMaterials > MaterialTable::MAX_MATERIALS) return false;
+      vector<Colour> materials(numMaterials);
+      for (Colour& material : materials) {
+        if (!in.read(material)) return false;
+      }
+
+      uint32_t numGObjects;
+      if (!in.read(numGObjects)) return false;
+      vector<GObject> loaded(numGObjects);
+      for (GObject& gobject : loaded) {
+        Colour& colour = gobject.colour;
+        if (!in.read(gobject.name) || !in.read(colour)) return false;
+        Mesh& mesh = gobject.mesh;
+        if (!in.read(mesh.vertices) || !in.read(mesh.indices) || !in.read(mesh.faceMaterials) ||
+            !in.read(mesh.faceTextures) || !in.read(mesh.textureVertices) || !in.read(mesh.textureIndices)) return false;
+
+        int numFaces = mesh.faceMaterials.size();
+        bool textured = !mesh.textureIndices.empty();
+        if (mesh.indices.size() != 3 * (size_t)numFaces || mesh.faceTextures.size() != (size_t)numFaces) return false;
+        if (textured && mesh.textureIndices.size() != 3 * (size_t)numFaces) return false;
+        for (uint32_t index : mesh.indices) {
+          if (index >= mesh.vertices.size()) return false;
+        }
+        for (int f = 0; f < numFaces; f++) {
+          if (mesh.faceMaterials[f] >= numMaterials) return false;
+          if (mesh.faceTextures[f] == -1) continue;
+          if (!textured || mesh.faceTextures[f] < 0 || mesh.faceTextures[f] >= (int)numTextures) return false;
+          for (int k = 0; k < 3; k++) {
+            if (mesh.textureIndices[(3 * f) + k] >= mesh.textureVertices.size()) return false;
+          }
+        }
+        gobject.updateBounds();
+      }
+
+      if (!in.read(nodes) || !in.read(order)) return false;
+
+      for (const string& textureFile : textureFiles) textures.load(textureFile);
+      vector<MaterialId> ids(numMaterials);
+      for (uint32_t m = 0; m < numMaterials; m++) ids[m] = MaterialTable::shared().intern(materials[m]);
+      for (GObject& gobject : loaded) {
+        for (MaterialId& material : gobject.mesh.faceMaterials) material = ids[material];
+      }
+      gobjects.swap(loaded);
+      return true;
+    }
+
+    // Saves the scene as name, read from sources, with its BVH already
+    // built. Returns false (saving nothing) if it can't be written.
+    bool save(const string& name, const vector<string>& sources, const vector<GObject>& gobjects,
+              const TextureRegistry& textures, const BVH& bvh) {
+      mkdir(directory.c_str(), 0755);
+      string path = pathFor(name);
+      // Written alongside and renamed into place, so a run that stops
+      // partway leaves no half a file to load
+      string partial = path + ".partial";
+      FILE* f = fopen(partial.c_str(), "wb");
+      if (f == NULL) return false;
+      Writer out(f);
+
+      out.write(MAGIC, sizeof(MAGIC));
+      out.write(VERSION);
+      out.write(name);
+      out.write((uint32_t)sources.size());
+      for (const string& source : sources) {
+        int64_t size = 0, modified = 0;
+        fileStamp(source, size, modified);
+        out.write(source);
+        out.write(size);
+        out.write(modified);
+      }
+
+      out.write((uint32_t)textures.size());
+      for (int t = 0; t < textures.size(); t++) out.write(textures.get(t)->textureFilename);
+
+      const MaterialTable& materials = MaterialTable::shared();
+      out.write((uint32_t)materials.size());
+      for (int m = 0; m < materials.size(); m++) out.write(materials.colour(m));
+
+      out.write((uint32_t)gobjects.size());
+      for (const GObject& gobject : gobjects) {
+        const Mesh& mesh = gobject.mesh;
+        out.write(gobject.name);
+        out.write(gobject.colour);
+        out.write(mesh.vertices);
+        out.write(mesh.indices);
+        out.write(mesh.faceMaterials);
+        out.write(mesh.faceTextures);
+        out.write(mesh.textureVertices);
+        out.write(mesh.textureIndices);
+      }
+
+      out.write(bvh.nodes);
+      out.write(bvh.triangleOrder());
+
+      bool written = out.ok;
+      if (fclose(f) != 0) written = false;
+      if (!written || rename(partial.c_str(), path.c_str()) != 0) {
+        remove(partial.c_str());
+        return false;
+      }
+      return true;
+    }
+
+    // The cache file for the scene called name
+    string pathFor(const string& name) const {
+      char hex[17];
+      snprintf(hex, sizeof(hex), "%016zx", hash<string>()(name));
+      return directory + "scene-" + hex + ".cache";
+    }
+
+  private:
+    static constexpr char MAGIC[8] = {'R', 'S', 'C', 'E', 'N', 'E', '\r', '\n'};
+    // Bump this whenever the layout, or what loading a scene does to it
+    // before it's saved, changes
+    static constexpr uint32_t VERSION = 3;
+
+    string directory = "./";
+
+    // Reads values from a mapped file, failing (rather than reading past
+    // the end) if the file is cut short
+    struct Reader {
+      const char* p;
+      const char* end;
+
+      Reader(const char* begin, const char* finish) : p(begin), end(finish) {}
+
+      bool has(size_t bytes) const { return (size_t)(end - p) >= bytes; }
+
+      bool read(void* out, size_t bytes) {
+        if (!has(bytes)) return false;
+        memcpy(out, p, bytes);
+        p += bytes;
+        return true;
+      }
+
+      template <typename T>
+      bool read(T& value) { return read(&value, sizeof(T)); }
+
+      // A count, then that many values
+      template <typename T>
+      bool read(vector<T>& values) {
+        uint32_t count;
+        if (!read(count) || !has(count * sizeof(T))) return false;
+        values.resize(count);
+        return read(values.data(), count * sizeof(T));
+      }
+
+      bool read(Colour& colour) {
+        return read(colour.name) && read(colour.red) && read(colour.green) && read(colour.blue);
+      }
+
+      bool read(string& value) {
+        uint32_t length;
+        if (!read(length) || !has(length)) return false;
+        value.assign(p, length);
+        p += length;
+        return true;
+      }
+    };
+
+    struct Writer {
+      FILE* f;
+      bool ok = true;
+
+      Writer(FILE* file) : f(file) {}
+
+      void write(const void* data, size_t bytes) {
+        if (bytes > 0 && fwrite(data, 1, bytes, f) != bytes) ok = false;
+      }
+
+      template <typename T>
+      void write(const T& value) { write(&value, sizeof(T)); }
+
+      template <typename T>
+      void write(const vector<T>& values) {
+        write((uint32_t)values.size());
+        write(values.data(), values.size() * sizeof(T));
+      }
+
+      void write(const Colour& colour) {
+        write(colour.name);
+        write(colour.red);
+        write(colour.green);
+        write(colour.blue);
+      }
+
+      void write(const string& value) {
+        write((uint32_t)value.size());
+        write(value.data(), value.size());
+      }
+    };
+
+    // A file's size and modification time (in nanoseconds)
+    static bool fileStamp(const string& filename, int64_t& size, int64_t& modified) {
+      struct stat info;
+      if (stat(filename.c_str(), &info) != 0) return false;
+      size = info.st_size;
+      modified = ((int64_t)info.st_mtim.tv_sec * 1000000000) + info.st_mtim.tv_nsec;
+      return true;
+    }
+};
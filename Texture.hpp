@@ -2,11 +2,28 @@
 
 #include <string>
 #include <fstream>
+#include <vector>
+#include <cmath>
+#include <algorithm>
 
+// How textured pixels sample their texture: the nearest texel of the full
+// size image; a bilinear blend of the four nearest texels of the mip level
+// closest to the pixel's size; or a blend of bilinear samples from the two
+// levels either side of it.
+enum TextureFilter { FILTER_NEAREST, FILTER_BILINEAR, FILTER_TRILINEAR };
+
+// An image loaded from a PPM file, with a chain of mip levels each half the
+// size of the last, down to 1x1. Texels are 0x00RRGGBB. Each level is stored
+// in 4x4 tiles of texels, a 64 byte cache line each, in row-major order; the
+// texels within a tile are in Morton (Z) order. Neighbouring texels in either
+// direction are then usually in the same cache line, which a row-major image
+// only manages along a row.
+//
+// Texture coordinates are in texels of the full size image, with texel
+// (i, j)'s centre at (i, j). Lookups outside the image clamp to its edge.
 class Texture {
   public:
     string textureFilename;
-    uint32_t* ppm_image;
     int width, height;
     int maxcolour;
 
@@ -37,17 +54,162 @@ class Texture {
       }
 
       uint8_t linebuf[3 * width];
-      ppm_image = (uint32_t*)malloc(width*height*sizeof(uint32_t));
+      std::vector<uint32_t> image(width * height, 0);
 
       int y = 0;
-      while(!feof(f)) {
-        fread(&linebuf, 1, 3*width, f);
+      while(y < height && fread(&linebuf, 1, 3*width, f) == (size_t)(3*width)) {
         for (int i = 0; i < width; i++) {
           uint32_t colour = (0x00 << 24) + (linebuf[3*i] << 16) + (linebuf[3*i + 1] << 8) + linebuf[3*i + 2];
-          ppm_image[y*width + i] = colour;
+          image[y*width + i] = colour;
         }
         y++;
       }
       fclose(f);
+      buildLevels(image);
+    }
+
+    // A texture from a row-major image already in memory
+    Texture(int imageWidth, int imageHeight, const std::vector<uint32_t>& image) {
+      width = imageWidth;
+      height = imageHeight;
+      maxcolour = 255;
+      buildLevels(image);
+    }
+
+    int levels() const { return mips.size(); }
+
+    // Texel (x, y) of the given mip level, which must be inside it
+    uint32_t texel(int x, int y, int level = 0) const {
+      const Level& mip = mips[level];
+      return mip.texels[mip.start + tiledIndex(mip, x, y)];
+    }
+
+    // The colour at (x, y) for a pixel lod mip levels down, i.e. one that
+    // covers 2^lod texels across (see lodFor())
+    uint32_t sample(float x, float y, float lod, TextureFilter filter) const {
+      if (filter == FILTER_NEAREST) {
+        // Texture coordinates of exactly 1.0 land one past the last texel
+        int tx = std::clamp((int)round(x), 0, width - 1);
+        int ty = std::clamp((int)round(y), 0, height - 1);
+        return texel(tx, ty);
+      }
+      lod = std::clamp(lod, 0.0f, (float)(levels() - 1));
+      if (filter == FILTER_BILINEAR) return bilinear(x, y, (int)(lod + 0.5f));
+      int level = (int)lod;
+      uint32_t fine = bilinear(x, y, level);
+      uint32_t weight = (uint32_t)((lod - level) * 256.0f);
+      if (weight == 0) return fine;
+      return blend(fine, bilinear(x, y, level + 1), weight);
+    }
+
+    // The mip level for a pixel whose texture coordinates change by
+    // (dudx, dvdx) one pixel right and (dudy, dvdy) one pixel down: log2 of
+    // the longer of the two, so a pixel covering 4 texels across is level 2
+    static float lodFor(float dudx, float dvdx, float dudy, float dvdy) {
+      float across = std::max((dudx * dudx) + (dvdx * dvdx), (dudy * dudy) + (dvdy * dvdy));
+      if (!(across > 0.0f)) return 0.0f;
+      return 0.5f * std::log2(across);
+    }
+
+  private:
+    static constexpr int TILE_SIZE = 4;
+
+    struct Level {
+      int width, height, tilesAcross;
+      // The tiles start at texels[start], which is on a 64 byte boundary
+      // (unless the Texture has since been copied, which only costs speed)
+      std::vector<uint32_t> texels;
+      int start;
+    };
+    std::vector<Level> mips;
+
+    // A texel's index is the sum of a part from its column and a part from
+    // its row: which tile, and the low two bits of x and y interleaved
+    static int columnIndex(int x) {
+      return ((x >> 2) << 4) | (x & 1) | ((x & 2) << 1);
+    }
+
+    static int rowIndex(const Level& mip, int y) {
+      return (((y >> 2) * mip.tilesAcross) << 4) | ((y & 1) << 1) | ((y & 2) << 2);
+    }
+
+    static int tiledIndex(const Level& mip, int x, int y) {
+      return columnIndex(x) + rowIndex(mip, y);
+    }
+
+    // Each level's texels are the average of the 2x2 texels above them (the
+    // last row or column of an odd sized level only counts once)
+    void buildLevels(const std::vector<uint32_t>& image) {
+      mips.clear();
+      std::vector<uint32_t> rows = image;
+      int w = width, h = height;
+      while (true) {
+        addLevel(rows, w, h);
+        if (w == 1 && h == 1) break;
+        int nextW = std::max(1, w / 2), nextH = std::max(1, h / 2);
+        std::vector<uint32_t> next(nextW * nextH);
+        for (int y = 0; y < nextH; y++) {
+          for (int x = 0; x < nextW; x++) {
+            int x0 = std::min(2 * x, w - 1), x1 = std::min((2 * x) + 1, w - 1);
+            int y0 = std::min(2 * y, h - 1), y1 = std::min((2 * y) + 1, h - 1);
+            uint32_t quad[4] = {rows[x0 + (y0 * w)], rows[x1 + (y0 * w)], rows[x0 + (y1 * w)], rows[x1 + (y1 * w)]};
+            uint32_t colour = 0;
+            for (int shift = 0; shift <= 16; shift += 8) {
+              uint32_t sum = 2;
+              for (int k = 0; k < 4; k++) sum += (quad[k] >> shift) & 0xff;
+              colour |= (sum / 4) << shift;
+            }
+            next[x + (y * nextW)] = colour;
+          }
+        }
+        rows.swap(next);
+        w = nextW;
+        h = nextH;
+      }
+    }
+
+    void addLevel(const std::vector<uint32_t>& rows, int w, int h) {
+      Level mip;
+      mip.width = w;
+      mip.height = h;
+      mip.tilesAcross = (w + TILE_SIZE - 1) / TILE_SIZE;
+      int tilesDown = (h + TILE_SIZE - 1) / TILE_SIZE;
+      // Room to move the start up to the next cache line
+      const int lineTexels = 64 / sizeof(uint32_t);
+      mip.texels.assign((mip.tilesAcross * tilesDown * TILE_SIZE * TILE_SIZE) + lineTexels, 0);
+      uintptr_t address = (uintptr_t)mip.texels.data();
+      mip.start = ((64 - (address % 64)) % 64) / sizeof(uint32_t);
+      for (int y = 0; y < h; y++) {
+        for (int x = 0; x < w; x++) mip.texels[mip.start + tiledIndex(mip, x, y)] = rows[x + (y * w)];
+      }
+      mips.push_back(std::move(mip));
+    }
+
+    // The four texels around (x, y) (in full size texels) on the given
+    // level, weighted by how close each is
+    uint32_t bilinear(float x, float y, int level) const {
+      const Level& mip = mips[level];
+      float scale = 1.0f / (1 << level);
+      float lx = std::clamp(((x + 0.5f) * scale) - 0.5f, -1.0f, (float)mip.width);
+      float ly = std::clamp(((y + 0.5f) * scale) - 0.5f, -1.0f, (float)mip.height);
+      float fx = std::floor(lx), fy = std::floor(ly);
+      uint32_t wx = (uint32_t)((lx - fx) * 256.0f), wy = (uint32_t)((ly - fy) * 256.0f);
+      int x0 = std::clamp((int)fx, 0, mip.width - 1), x1 = std::clamp((int)fx + 1, 0, mip.width - 1);
+      int y0 = std::clamp((int)fy, 0, mip.height - 1), y1 = std::clamp((int)fy + 1, 0, mip.height - 1);
+      const uint32_t* top = mip.texels.data() + mip.start + rowIndex(mip, y0);
+      const uint32_t* bottom = mip.texels.data() + mip.start + rowIndex(mip, y1);
+      int left = columnIndex(x0), right = columnIndex(x1);
+      uint32_t above = blend(top[left], top[right], wx);
+      uint32_t below = blend(bottom[left], bottom[right], wx);
+      return blend(above, below, wy);
+    }
+
+    // a and b mixed, weighting b by weight/256; red and blue are mixed
+    // together, each in its own 16 bits
+    static uint32_t blend(uint32_t a, uint32_t b, uint32_t weight) {
+      uint32_t keep = 256 - weight;
+      uint32_t rb = (((a & 0xff00ff) * keep) + ((b & 0xff00ff) * weight)) >> 8;
+      uint32_t g = (((a & 0x00ff00) * keep) + ((b & 0x00ff00) * weight)) >> 8;
+      return (rb & 0xff00ff) | (g & 0x00ff00);
     }
 };
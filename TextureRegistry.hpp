@@ -0,0 +1,38 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include "Texture.hpp"
+
+// Every loaded texture, each known by a small integer handle handed out when
+// its OBJ is loaded. Triangles and the points interpolated across them carry
+// the handle, so finding a pixel's texture is an array index rather than a
+// search by filename. Handle -1 means no texture.
+class TextureRegistry {
+  public:
+    TextureRegistry() {}
+
+    // The handle of the texture in the given image, loading it the first
+    // time it's asked for
+    int load(const std::string& filename) {
+      for (uint i = 0; i < textures.size(); i++) {
+        if (textures[i].textureFilename == filename) return i;
+      }
+      textures.push_back(Texture(filename));
+      return textures.size() - 1;
+    }
+
+    // The texture with the given handle, or nullptr if there isn't one
+    const Texture* get(int handle) const {
+      if (handle < 0 || handle >= (int)textures.size()) return nullptr;
+      return &textures[handle];
+    }
+
+    int size() const { return textures.size(); }
+
+    // Frees every texture; their handles mean nothing afterwards
+    void clear() { textures.clear(); }
+
+  private:
+    std::vector<Texture> textures;
+};
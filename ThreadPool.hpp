@@ -0,0 +1,144 @@
+#pragma once
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <vector>
+#include <memory>
+#include <functional>
+
+using namespace std;
+
+// A fixed set of worker threads that share out the tasks of one run() call at
+// a time. Each worker is dealt a contiguous slice of the task indices and,
+// once its own queue is empty, steals from the back of the others' queues,
+// so uneven tasks (e.g. tiles full of teapot vs. empty background) balance
+// out. The calling thread takes part as worker 0.
+class ThreadPool {
+  public:
+    ThreadPool () {}
+
+    ThreadPool (int n) {
+      setThreadCount(n);
+    }
+
+    ~ThreadPool() {
+      stopWorkers();
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    int size() { return queues.size() > 0 ? queues.size() : 1; }
+
+    void setThreadCount(int n) {
+      if (n < 1) n = 1;
+      stopWorkers();
+      queues.clear();
+      for (int i=0; i<n; i++) queues.push_back(make_unique<WorkQueue>());
+      stopping = false;
+      for (int i=1; i<n; i++) workers.push_back(thread(&ThreadPool::workerLoop, this, i));
+    }
+
+    // Calls task(i) for every i in [0, numTasks), returning once all are done.
+    void run(int numTasks, const function<void(int)>& task) {
+      if (workers.empty() || numTasks <= 1) {
+        for (int i=0; i<numTasks; i++) task(i);
+        return;
+      }
+
+      int n = queues.size();
+      for (int w=0; w<n; w++) {
+        lock_guard<mutex> lock(queues[w]->m);
+        queues[w]->tasks.clear();
+        for (int i=(w * numTasks) / n; i<((w + 1) * numTasks) / n; i++) queues[w]->tasks.push_back(i);
+      }
+
+      {
+        lock_guard<mutex> lock(m);
+        currentTask = &task;
+        busyWorkers = workers.size();
+        generation++;
+      }
+      wake.notify_all();
+
+      work(0);
+
+      unique_lock<mutex> lock(m);
+      allDone.wait(lock, [&]{ return busyWorkers == 0; });
+      currentTask = nullptr;
+    }
+
+  private:
+    struct WorkQueue {
+      mutex m;
+      deque<int> tasks;
+    };
+
+    vector<unique_ptr<WorkQueue>> queues;
+    vector<thread> workers;
+
+    mutex m;
+    condition_variable wake;
+    condition_variable allDone;
+    const function<void(int)>* currentTask = nullptr;
+    unsigned long generation = 0;
+    int busyWorkers = 0;
+    bool stopping = false;
+
+    void stopWorkers() {
+      {
+        lock_guard<mutex> lock(m);
+        stopping = true;
+      }
+      wake.notify_all();
+      for (uint i=0; i<workers.size(); i++) workers[i].join();
+      workers.clear();
+    }
+
+    void workerLoop(int id) {
+      unsigned long seen = 0;
+      while (true) {
+        {
+          unique_lock<mutex> lock(m);
+          wake.wait(lock, [&]{ return stopping || generation != seen; });
+          if (stopping) return;
+          seen = generation;
+        }
+        work(id);
+        {
+          lock_guard<mutex> lock(m);
+          busyWorkers--;
+          if (busyWorkers == 0) allDone.notify_all();
+        }
+      }
+    }
+
+    void work(int id) {
+      int task;
+      while (popOwn(id, task) || steal(id, task)) (*currentTask)(task);
+    }
+
+    bool popOwn(int id, int& task) {
+      WorkQueue& q = *queues[id];
+      lock_guard<mutex> lock(q.m);
+      if (q.tasks.empty()) return false;
+      task = q.tasks.front();
+      q.tasks.pop_front();
+      return true;
+    }
+
+    bool steal(int id, int& task) {
+      int n = queues.size();
+      for (int k=1; k<n; k++) {
+        WorkQueue& q = *queues[(id + k) % n];
+        lock_guard<mutex> lock(q.m);
+        if (q.tasks.empty()) continue;
+        task = q.tasks.back();
+        q.tasks.pop_back();
+        return true;
+      }
+      return false;
+    }
+};
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <vector>
+
+// Lists of the triangles (by index) that overlap each screen tile, filled by
+// several binning tasks at once. Every task has its own set of lists, so the
+// tasks never contend, and a tile's triangles are read back task by task: as
+// long as each task bins a later range of triangles than the one before,
+// every tile sees its triangles in their original order, whichever threads
+// ran the tasks. The lists keep their memory from frame to frame.
+class TileBins {
+  public:
+    int tilesAcross = 0, tilesDown = 0;
+
+    TileBins() {}
+
+    // Empties every list, ready for numTasks tasks to bin into a grid of
+    // across x down tiles
+    void reset(int across, int down, int numTasks) {
+      tilesAcross = across;
+      tilesDown = down;
+      if ((int)bins.size() < numTasks) bins.resize(numTasks);
+      tasksUsed = numTasks;
+      for (int t=0; t<numTasks; t++) {
+        bins[t].resize(across * down);
+        for (uint i=0; i<bins[t].size(); i++) bins[t][i].clear();
+      }
+    }
+
+    void add(int task, int tile, int triangle) {
+      bins[task][tile].push_back(triangle);
+    }
+
+    bool empty(int tile) const {
+      for (int t=0; t<tasksUsed; t++) {
+        if (!bins[t][tile].empty()) return false;
+      }
+      return true;
+    }
+
+    // Calls visit(triangle) for each of the tile's triangles, in order
+    template <typename Visitor>
+    void forEach(int tile, Visitor visit) const {
+      for (int t=0; t<tasksUsed; t++) {
+        const std::vector<int>& list = bins[t][tile];
+        for (uint i=0; i<list.size(); i++) visit(list[i]);
+      }
+    }
+
+  private:
+    // bins[task][tile]
+    std::vector<std::vector<std::vector<int>>> bins;
+    int tasksUsed = 0;
+};
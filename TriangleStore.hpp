@@ -0,0 +1,307 @@
+#pragma once
+
+#include <glm/glm.hpp>
+#include <vector>
+#include <limits>
+#include <string>
+#include <algorithm>
+#include <cstdint>
+#include "Mesh.hpp"
+
+// The SSE/AVX2 kernels are compiled for x86 whatever the -march flags say
+// (each function is tagged with its own target), and only used if the CPU
+// running the program turns out to support them.
+#if defined(__x86_64__) || defined(__i386__)
+#define TRIANGLE_STORE_X86_SIMD
+#include <immintrin.h>
+#endif
+
+using namespace std;
+using namespace glm;
+
+// Result of a ray query against a TriangleStore. The triangle is referred to
+// by its index in the store (source[triangle] gets back to its mesh face for
+// shading) rather than copied, and t is in units of the ray direction,
+// i.e. the hit is at origin + t*rayDir.
+struct RayHit {
+  int triangle = -1;
+  float t = numeric_limits<float>::infinity();
+  float u = 0.0f, v = 0.0f;
+
+  bool found() const { return triangle >= 0; }
+};
+
+// A face of a gobject's mesh
+struct FaceRef {
+  const Mesh* mesh;
+  int face;
+};
+
+enum SimdLevel {SIMD_SCALAR, SIMD_SSE, SIMD_AVX2};
+
+inline SimdLevel detectSimdLevel() {
+#ifdef TRIANGLE_STORE_X86_SIMD
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) return SIMD_AVX2;
+  if (__builtin_cpu_supports("sse4.2")) return SIMD_SSE;
+#endif
+  return SIMD_SCALAR;
+}
+
+inline string simdLevelName(SimdLevel level) {
+  if (level == SIMD_AVX2) return "avx2";
+  if (level == SIMD_SSE) return "sse4.2";
+  return "scalar";
+}
+
+// The scene's triangles compiled for ray intersection: one vertex and the
+// two edges out of it (which is all Moller-Trumbore needs), plus the unit
+// normal for shading, each stored structure-of-arrays so that consecutive
+// triangles' components sit next to each other in memory.
+class TriangleStore {
+  public:
+    vector<float> v0x, v0y, v0z;
+    vector<float> e0x, e0y, e0z;
+    vector<float> e1x, e1y, e1z;
+    vector<float> nx, ny, nz;
+    vector<FaceRef> source;
+    // Triangles only seen from the front (counter-clockwise) side, which
+    // rays may skip hitting from behind
+    vector<uint8_t> singleSided;
+
+    // Which intersect8 kernel to use; defaults to the best this CPU has
+    SimdLevel simdLevel = detectSimdLevel();
+    // Whether rays ignore the back faces of single-sided triangles
+    bool cullBackFaces = false;
+
+    // intersect8 always reads BATCH triangles' worth of each array, so
+    // finish() pads them with this many degenerate (never hit) triangles
+    static constexpr int BATCH = 8;
+
+    TriangleStore () {}
+
+    int size() const { return source.size(); }
+
+    void clear() {
+      vector<float>* fields[] = {&v0x, &v0y, &v0z, &e0x, &e0y, &e0z, &e1x, &e1y, &e1z, &nx, &ny, &nz};
+      for (int k=0; k<12; k++) fields[k]->clear();
+      source.clear();
+      singleSided.clear();
+    }
+
+    // Call once all the triangles have been added
+    void finish() {
+      vector<float>* fields[] = {&v0x, &v0y, &v0z, &e0x, &e0y, &e0z, &e1x, &e1y, &e1z, &nx, &ny, &nz};
+      for (int k=0; k<12; k++) fields[k]->resize(source.size() + BATCH - 1, 0.0f);
+      singleSided.resize(source.size() + BATCH - 1, 0);
+    }
+
+    void add(FaceRef triangle, bool isSingleSided = false) {
+      vec3 v0 = triangle.mesh->vertex(triangle.face, 0);
+      vec3 e0 = triangle.mesh->vertex(triangle.face, 1) - v0;
+      vec3 e1 = triangle.mesh->vertex(triangle.face, 2) - v0;
+      vec3 n = glm::normalize(glm::cross(e1, e0));
+      v0x.push_back(v0.x); v0y.push_back(v0.y); v0z.push_back(v0.z);
+      e0x.push_back(e0.x); e0y.push_back(e0.y); e0z.push_back(e0.z);
+      e1x.push_back(e1.x); e1y.push_back(e1.y); e1z.push_back(e1.z);
+      nx.push_back(n.x); ny.push_back(n.y); nz.push_back(n.z);
+      source.push_back(triangle);
+      singleSided.push_back(isSingleSided);
+    }
+
+    vec3 vertex0(int i) const { return vec3(v0x[i], v0y[i], v0z[i]); }
+    vec3 edge0(int i) const { return vec3(e0x[i], e0y[i], e0z[i]); }
+    vec3 edge1(int i) const { return vec3(e1x[i], e1y[i], e1z[i]); }
+    vec3 normal(int i) const { return vec3(nx[i], ny[i], nz[i]); }
+
+    vec3 pointAt(int i, float u, float v) const {
+      return vertex0(i) + (u * edge0(i)) + (v * edge1(i));
+    }
+
+    // Moller-Trumbore ray/triangle test. Accepts hits with 0 <= t < tMax,
+    // writing t and the barycentrics (u along edge0, v along edge1). All the
+    // conditions are evaluated and combined at the end rather than bailing
+    // out early, since which one fails is close to random from test to test
+    // and mispredicted branches cost more than the arithmetic they'd skip.
+    bool intersect(int i, vec3 origin, vec3 rayDir, float tMax, float& t, float& u, float& v) const {
+      vec3 e0 = edge0(i);
+      vec3 e1 = edge1(i);
+      vec3 p = glm::cross(rayDir, e1);
+      float det = glm::dot(e0, p);
+      float invDet = 1.0f / det;
+
+      vec3 s = origin - vertex0(i);
+      vec3 q = glm::cross(s, e0);
+      u = glm::dot(s, p) * invDet;
+      v = glm::dot(rayDir, q) * invDet;
+      t = glm::dot(e1, q) * invDet;
+      return (det != 0.0f) & (u >= 0.0f) & (v >= 0.0f) & (u + v <= 1.0f) & (t >= 0.0f) & (t < tMax);
+    }
+
+    // Tests the ray against triangles first..first+count-1 (count <= BATCH)
+    // in one go, returning a bitmask of the ones hit (bit k for triangle
+    // first+k) and writing their t/u/v to the k'th entries of the arrays.
+    unsigned intersect8(int first, int count, vec3 origin, vec3 rayDir, float tMax, float* t, float* u, float* v) const {
+      unsigned mask;
+#ifdef TRIANGLE_STORE_X86_SIMD
+      if (simdLevel == SIMD_AVX2) mask = intersect8AVX2(first, origin, rayDir, tMax, t, u, v);
+      else if (simdLevel == SIMD_SSE) {
+        mask = intersect4SSE(first, origin, rayDir, tMax, t, u, v);
+        if (count > 4) mask |= intersect4SSE(first + 4, origin, rayDir, tMax, t + 4, u + 4, v + 4) << 4;
+      }
+      else
+#endif
+      mask = intersect8Scalar(first, count, origin, rayDir, tMax, t, u, v);
+      mask &= (1u << count) - 1;
+      if (cullBackFaces && mask != 0) mask = cullBackFacing(first, rayDir, mask);
+      return mask;
+    }
+
+    // Back faces culled on this thread since the last call; see BVH::trace()
+    static unsigned long takeCulledCount() {
+      unsigned long n = culledCount;
+      culledCount = 0;
+      return n;
+    }
+
+    // Finds the nearest hit closer than tMax among triangles
+    // first..first+count-1, updating hit and shrinking tMax to it.
+    void closestInRange(int first, int count, vec3 origin, vec3 rayDir, float& tMax, RayHit& hit) const {
+      float t[BATCH], u[BATCH], v[BATCH];
+      for (int b=0; b<count; b+=BATCH) {
+        unsigned mask = intersect8(first + b, std::min(BATCH, count - b), origin, rayDir, tMax, t, u, v);
+        for (int k=0; mask != 0; k++, mask >>= 1) {
+          if ((mask & 1) && t[k] < tMax) {
+            tMax = t[k];
+            hit.triangle = first + b + k;
+            hit.t = t[k];
+            hit.u = u[k];
+            hit.v = v[k];
+          }
+        }
+      }
+    }
+
+    // True if any triangle in first..first+count-1 other than ignore is hit
+    // closer than tMax. Stops at the first batch with a hit.
+    bool anyInRange(int first, int count, vec3 origin, vec3 rayDir, float tMax, int ignore = -1) const {
+      float t[BATCH], u[BATCH], v[BATCH];
+      for (int b=0; b<count; b+=BATCH) {
+        unsigned mask = intersect8(first + b, std::min(BATCH, count - b), origin, rayDir, tMax, t, u, v);
+        unsigned self = ignore - (first + b);
+        if (self < (unsigned)BATCH) mask &= ~(1u << self);
+        if (mask != 0) return true;
+      }
+      return false;
+    }
+
+    // Occlusion test by brute force, for when there's no BVH over the store
+    bool occluded(vec3 origin, vec3 rayDir, float tMax, int ignore = -1) const {
+      return anyInRange(0, size(), origin, rayDir, tMax, ignore);
+    }
+
+  private:
+    static inline thread_local unsigned long culledCount = 0;
+
+    // Clears the bits of hits on the back of single-sided triangles. Only
+    // hits get this far, so it's rarely more than a lane or two. The stored
+    // normal is e1 x e0, which points out of the back face, the same way as
+    // rays that hit the front.
+    unsigned cullBackFacing(int first, vec3 rayDir, unsigned mask) const {
+      for (unsigned bits = mask; bits != 0; bits &= bits - 1) {
+        int i = first + __builtin_ctz(bits);
+        if (singleSided[i] && glm::dot(rayDir, normal(i)) < 0.0f) {
+          mask &= ~(1u << (i - first));
+          culledCount++;
+        }
+      }
+      return mask;
+    }
+
+    unsigned intersect8Scalar(int first, int count, vec3 origin, vec3 rayDir, float tMax, float* t, float* u, float* v) const {
+      unsigned mask = 0;
+      for (int k=0; k<count; k++) {
+        if (intersect(first + k, origin, rayDir, tMax, t[k], u[k], v[k])) mask |= 1u << k;
+      }
+      return mask;
+    }
+
+#ifdef TRIANGLE_STORE_X86_SIMD
+    // Same sums as intersect(), a lane per triangle
+    __attribute__((target("avx2")))
+    unsigned intersect8AVX2(int first, vec3 origin, vec3 rayDir, float tMax, float* t, float* u, float* v) const {
+      __m256 dx = _mm256_set1_ps(rayDir.x), dy = _mm256_set1_ps(rayDir.y), dz = _mm256_set1_ps(rayDir.z);
+      __m256 e0X = _mm256_loadu_ps(&e0x[first]), e0Y = _mm256_loadu_ps(&e0y[first]), e0Z = _mm256_loadu_ps(&e0z[first]);
+      __m256 e1X = _mm256_loadu_ps(&e1x[first]), e1Y = _mm256_loadu_ps(&e1y[first]), e1Z = _mm256_loadu_ps(&e1z[first]);
+
+      // p = rayDir x e1
+      __m256 px = _mm256_sub_ps(_mm256_mul_ps(dy, e1Z), _mm256_mul_ps(e1Y, dz));
+      __m256 py = _mm256_sub_ps(_mm256_mul_ps(dz, e1X), _mm256_mul_ps(e1Z, dx));
+      __m256 pz = _mm256_sub_ps(_mm256_mul_ps(dx, e1Y), _mm256_mul_ps(e1X, dy));
+      __m256 det = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(e0X, px), _mm256_mul_ps(e0Y, py)), _mm256_mul_ps(e0Z, pz));
+      __m256 invDet = _mm256_div_ps(_mm256_set1_ps(1.0f), det);
+
+      // s = origin - v0, q = s x e0
+      __m256 sx = _mm256_sub_ps(_mm256_set1_ps(origin.x), _mm256_loadu_ps(&v0x[first]));
+      __m256 sy = _mm256_sub_ps(_mm256_set1_ps(origin.y), _mm256_loadu_ps(&v0y[first]));
+      __m256 sz = _mm256_sub_ps(_mm256_set1_ps(origin.z), _mm256_loadu_ps(&v0z[first]));
+      __m256 qx = _mm256_sub_ps(_mm256_mul_ps(sy, e0Z), _mm256_mul_ps(e0Y, sz));
+      __m256 qy = _mm256_sub_ps(_mm256_mul_ps(sz, e0X), _mm256_mul_ps(e0Z, sx));
+      __m256 qz = _mm256_sub_ps(_mm256_mul_ps(sx, e0Y), _mm256_mul_ps(e0X, sy));
+
+      __m256 U = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(sx, px), _mm256_mul_ps(sy, py)), _mm256_mul_ps(sz, pz)), invDet);
+      __m256 V = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, qx), _mm256_mul_ps(dy, qy)), _mm256_mul_ps(dz, qz)), invDet);
+      __m256 T = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(e1X, qx), _mm256_mul_ps(e1Y, qy)), _mm256_mul_ps(e1Z, qz)), invDet);
+
+      __m256 zero = _mm256_setzero_ps();
+      __m256 hit = _mm256_cmp_ps(det, zero, _CMP_NEQ_OQ);
+      hit = _mm256_and_ps(hit, _mm256_cmp_ps(U, zero, _CMP_GE_OQ));
+      hit = _mm256_and_ps(hit, _mm256_cmp_ps(V, zero, _CMP_GE_OQ));
+      hit = _mm256_and_ps(hit, _mm256_cmp_ps(_mm256_add_ps(U, V), _mm256_set1_ps(1.0f), _CMP_LE_OQ));
+      hit = _mm256_and_ps(hit, _mm256_cmp_ps(T, zero, _CMP_GE_OQ));
+      hit = _mm256_and_ps(hit, _mm256_cmp_ps(T, _mm256_set1_ps(tMax), _CMP_LT_OQ));
+
+      _mm256_storeu_ps(t, T);
+      _mm256_storeu_ps(u, U);
+      _mm256_storeu_ps(v, V);
+      return _mm256_movemask_ps(hit);
+    }
+
+    __attribute__((target("sse4.2")))
+    unsigned intersect4SSE(int first, vec3 origin, vec3 rayDir, float tMax, float* t, float* u, float* v) const {
+      __m128 dx = _mm_set1_ps(rayDir.x), dy = _mm_set1_ps(rayDir.y), dz = _mm_set1_ps(rayDir.z);
+      __m128 e0X = _mm_loadu_ps(&e0x[first]), e0Y = _mm_loadu_ps(&e0y[first]), e0Z = _mm_loadu_ps(&e0z[first]);
+      __m128 e1X = _mm_loadu_ps(&e1x[first]), e1Y = _mm_loadu_ps(&e1y[first]), e1Z = _mm_loadu_ps(&e1z[first]);
+
+      __m128 px = _mm_sub_ps(_mm_mul_ps(dy, e1Z), _mm_mul_ps(e1Y, dz));
+      __m128 py = _mm_sub_ps(_mm_mul_ps(dz, e1X), _mm_mul_ps(e1Z, dx));
+      __m128 pz = _mm_sub_ps(_mm_mul_ps(dx, e1Y), _mm_mul_ps(e1X, dy));
+      __m128 det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e0X, px), _mm_mul_ps(e0Y, py)), _mm_mul_ps(e0Z, pz));
+      __m128 invDet = _mm_div_ps(_mm_set1_ps(1.0f), det);
+
+      __m128 sx = _mm_sub_ps(_mm_set1_ps(origin.x), _mm_loadu_ps(&v0x[first]));
+      __m128 sy = _mm_sub_ps(_mm_set1_ps(origin.y), _mm_loadu_ps(&v0y[first]));
+      __m128 sz = _mm_sub_ps(_mm_set1_ps(origin.z), _mm_loadu_ps(&v0z[first]));
+      __m128 qx = _mm_sub_ps(_mm_mul_ps(sy, e0Z), _mm_mul_ps(e0Y, sz));
+      __m128 qy = _mm_sub_ps(_mm_mul_ps(sz, e0X), _mm_mul_ps(e0Z, sx));
+      __m128 qz = _mm_sub_ps(_mm_mul_ps(sx, e0Y), _mm_mul_ps(e0X, sy));
+
+      __m128 U = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(sx, px), _mm_mul_ps(sy, py)), _mm_mul_ps(sz, pz)), invDet);
+      __m128 V = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, qx), _mm_mul_ps(dy, qy)), _mm_mul_ps(dz, qz)), invDet);
+      __m128 T = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(e1X, qx), _mm_mul_ps(e1Y, qy)), _mm_mul_ps(e1Z, qz)), invDet);
+
+      __m128 zero = _mm_setzero_ps();
+      __m128 hit = _mm_cmpneq_ps(det, zero);
+      hit = _mm_and_ps(hit, _mm_cmpge_ps(U, zero));
+      hit = _mm_and_ps(hit, _mm_cmpge_ps(V, zero));
+      hit = _mm_and_ps(hit, _mm_cmple_ps(_mm_add_ps(U, V), _mm_set1_ps(1.0f)));
+      hit = _mm_and_ps(hit, _mm_cmpge_ps(T, zero));
+      hit = _mm_and_ps(hit, _mm_cmplt_ps(T, _mm_set1_ps(tMax)));
+
+      _mm_storeu_ps(t, T);
+      _mm_storeu_ps(u, U);
+      _mm_storeu_ps(v, V);
+      return _mm_movemask_ps(hit);
+    }
+#endif
+};
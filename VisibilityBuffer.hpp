@@ -0,0 +1,36 @@
+#pragma once
+
+#include <vector>
+#include <algorithm>
+#include <atomic>
+
+// Per-pixel record of the triangle the rasteriser found nearest the camera,
+// by its index in the BVH's TriangleStore (-1 where nothing was drawn), and
+// the barycentric coordinates (u, v) of the pixel's ray on it. The hybrid
+// render mode shades from this instead of casting primary rays.
+class VisibilityBuffer {
+  public:
+    std::vector<int> triangle;
+    std::vector<float> u, v;
+    int width = 0, height = 0;
+
+    // Pixels whose ray missed the rasterised triangle (edges the two disagree
+    // on) and so fell back to a full primary ray; reset by clear()
+    std::atomic<unsigned long> fallbacks{0};
+
+    VisibilityBuffer() {}
+
+    void resize(int w, int h) {
+      width = w;
+      height = h;
+      triangle.assign(width * height, -1);
+      u.assign(width * height, 0.0f);
+      v.assign(width * height, 0.0f);
+      fallbacks = 0;
+    }
+
+    void clear() {
+      std::fill(triangle.begin(), triangle.end(), -1);
+      fallbacks = 0;
+    }
+};
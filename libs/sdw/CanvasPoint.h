@@ -12,6 +12,10 @@ class CanvasPoint
 
     CanvasPoint()
     {
+        x = 0.0f;
+        y = 0.0f;
+        depth = 0.0;
+        brightness = 1.0;
         texturePoint = TexturePoint(-1,-1);
     }
 
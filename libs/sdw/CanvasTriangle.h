@@ -5,11 +5,13 @@ class CanvasTriangle
 {
   public:
     CanvasPoint vertices[3];
-    Colour colour;
+    // The triangle's material, as an id in the MaterialTable
+    uint16_t material;
     bool textured;
 
     CanvasTriangle()
     {
+      material = 0;
       textured = false;
     }
 
@@ -18,16 +20,16 @@ class CanvasTriangle
       vertices[0] = v0;
       vertices[1] = v1;
       vertices[2] = v2;
-      colour = Colour(255,255,255);
+      material = 0;
       textured = false;
     }
 
-    CanvasTriangle(CanvasPoint v0, CanvasPoint v1, CanvasPoint v2, Colour c, bool tex)
+    CanvasTriangle(CanvasPoint v0, CanvasPoint v1, CanvasPoint v2, uint16_t m, bool tex)
     {
       vertices[0] = v0;
       vertices[1] = v1;
       vertices[2] = v2;
-      colour = c;
+      material = m;
       textured = tex;
     }
 
@@ -3,26 +3,28 @@
 class TexturePoint
 {
   public:
-    string textureName;
+    // Handle of the texture (see TextureRegistry), or -1 if none
+    int texture;
     float x;
     float y;
 
     TexturePoint()
     {
+      texture = -1;
     }
 
     TexturePoint(float xPos, float yPos)
     {
       x = xPos;
       y = yPos;
-      textureName = "UNASSIGNED";
+      texture = -1;
     }
 
-    TexturePoint(float xPos, float yPos, string tn)
+    TexturePoint(float xPos, float yPos, int textureHandle)
     {
       x = xPos;
       y = yPos;
-      textureName = tn;
+      texture = textureHandle;
     }
 
     void print()
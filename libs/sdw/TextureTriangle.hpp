@@ -5,12 +5,13 @@ using namespace glm;
 class TextureTriangle {
   public:
     vec2 vertices[3];
-    string textureFilename;
+    // Handle of the texture (see TextureRegistry), or -1 if none
+    int texture = -1;
 
     TextureTriangle () {}
 
-    TextureTriangle (string filename, vec2 a, vec2 b, vec2 c) {
-      textureFilename = filename;
+    TextureTriangle (int textureHandle, vec2 a, vec2 b, vec2 c) {
+      texture = textureHandle;
       vertices[0] = a;
       vertices[1] = b;
       vertices[2] = c;